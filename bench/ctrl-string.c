@@ -0,0 +1,78 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+// Compares sending a string typed with ctrl held key by key, with one write per key,
+// to translating it at once using ctrl_transform and writing it all at once.
+// Usage: bench-ctrl-string [length [iterations [output file]]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <key_transform.h>
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]){
+  size_t length = argc > 1 ? strtoul(argv[1], 0, 10) : 4096;
+  size_t iterations = argc > 2 ? strtoul(argv[2], 0, 10) : 100;
+  const char* output = argc > 3 ? argv[3] : "/dev/null";
+  if(!length || !iterations){
+    fprintf(stderr, "Usage: %s [length [iterations [output file]]]\n", argv[0]);
+    return 1;
+  }
+  int fd = open(output, O_WRONLY|O_CLOEXEC);
+  if(fd == -1){
+    perror("open failed");
+    return 1;
+  }
+  uint8_t* string = malloc(length);
+  uint8_t* buffer = malloc(length);
+  if(!string || !buffer){
+    perror("malloc failed");
+    return 1;
+  }
+  for(size_t i=0; i<length; i++)
+    string[i] = 'a' + i % 26;
+
+  double start = now();
+  for(size_t j=0; j<iterations; j++){
+    for(size_t i=0; i<length; i++){
+      uint8_t c = string[i];
+      ctrl_transform(1, &c);
+      if(write(fd, &c, 1) != 1){
+        perror("write failed");
+        return 1;
+      }
+    }
+  }
+  double per_key = now() - start;
+
+  start = now();
+  for(size_t j=0; j<iterations; j++){
+    memcpy(buffer, string, length);
+    size_t n = ctrl_transform(length, buffer);
+    if(write(fd, buffer, n) != (ssize_t)n){
+      perror("write failed");
+      return 1;
+    }
+  }
+  double bulk = now() - start;
+
+  size_t total = length * iterations;
+  printf("ctrl string, %zu bytes x %zu:\n", length, iterations);
+  printf("  per key: %10.2f ns/byte, %12.0f bytes/s\n", per_key / total * 1e9, total / per_key);
+  printf("  bulk:    %10.2f ns/byte, %12.0f bytes/s\n", bulk / total * 1e9, total / bulk);
+  printf("  speedup: %10.2fx\n", per_key / bulk);
+
+  free(string);
+  free(buffer);
+  close(fd);
+  return 0;
+}
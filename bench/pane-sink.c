@@ -0,0 +1,84 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+// The program in the top pane for benchmarks. Puts its terminal into raw mode,
+// reads everything typed, and measures the latency of the probes typed by
+// bench-keyboard. Once it gets "@E\r", it writes
+// "<end time> <bytes> <probes> <p50> <p99> <p99.9> <max>" to the result file,
+// with times in nanoseconds, and exits.
+// Usage: bench-sink [result file]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <termios.h>
+#include <errno.h>
+#include <ckm_time.h>
+#include <latency_histogram.h>
+
+static struct latency_histogram probes;
+
+int main(int argc, char* argv[]){
+  const char* result = argc > 1 ? argv[1] : "/dev/stdout";
+  struct termios tio;
+  if(tcgetattr(0, &tio) == -1){
+    perror("tcgetattr failed");
+    return 1;
+  }
+  cfmakeraw(&tio);
+  if(tcsetattr(0, TCSANOW, &tio) == -1){
+    perror("tcsetattr failed");
+    return 1;
+  }
+
+  unsigned long long total = 0;
+  bool in_probe = false;
+  bool end = false;
+  uint64_t sent = 0;
+  char buffer[4096];
+  while(!end){
+    ssize_t n = read(0, buffer, sizeof(buffer));
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n <= 0){
+      fprintf(stderr, "The input ended before the end marker\n");
+      return 1;
+    }
+    uint64_t now = ckm_now();
+    total += n;
+    for(ssize_t i=0; i<n && !end; i++){
+      char c = buffer[i];
+      if(c == '@'){
+        in_probe = true;
+        sent = 0;
+      }else if(!in_probe){
+        continue;
+      }else if(c >= '0' && c <= '9'){
+        sent = sent * 10 + (c - '0');
+      }else if(c == 'E'){
+        end = true;
+      }else{
+        if(c == '\r' && sent && sent <= now)
+          latency_histogram_add(&probes, now - sent);
+        in_probe = false;
+      }
+    }
+  }
+
+  FILE* f = fopen(result, "w");
+  if(!f){
+    perror("fopen failed");
+    return 1;
+  }
+  fprintf(f, "%llu %llu %llu %llu %llu %llu %llu\n",
+    (unsigned long long)ckm_now(), total, (unsigned long long)probes.count,
+    (unsigned long long)latency_histogram_percentile(&probes, 0.5),
+    (unsigned long long)latency_histogram_percentile(&probes, 0.99),
+    (unsigned long long)latency_histogram_percentile(&probes, 0.999),
+    (unsigned long long)probes.max
+  );
+  fclose(f);
+  return 0;
+}
@@ -0,0 +1,82 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+// Runs a program in a new pty instead of a real terminal, and discards whatever
+// it outputs. Exits with the exit status of the program.
+// TERM is set to xterm if it isn't set already.
+// Usage: bench-pty-run rows columns program [args]
+
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+int main(int argc, char* argv[]){
+  if(argc < 4){
+    fprintf(stderr, "Usage: %s rows columns program [args]\n", argv[0]);
+    return 1;
+  }
+  struct winsize size = {
+    .ws_row = atoi(argv[1]),
+    .ws_col = atoi(argv[2]),
+  };
+  int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if(master == -1 || grantpt(master) == -1 || unlockpt(master) == -1){
+    perror("failed to create a pty");
+    return 1;
+  }
+  if(ioctl(master, TIOCSWINSZ, &size) == -1){
+    perror("ioctl(TIOCSWINSZ) failed");
+    return 1;
+  }
+  const char* name = ptsname(master);
+  if(!name){
+    perror("ptsname failed");
+    return 1;
+  }
+  pid_t pid = fork();
+  if(pid == -1){
+    perror("fork failed");
+    return 1;
+  }
+  if(!pid){
+    if(setsid() == -1){
+      perror("setsid failed");
+      _exit(127);
+    }
+    int slave = open(name, O_RDWR);
+    if(slave == -1 || ioctl(slave, TIOCSCTTY, 0) == -1){
+      perror("failed to open the pts");
+      _exit(127);
+    }
+    for(int i=0; i<3; i++)
+      dup2(slave, i);
+    if(slave > 2)
+      close(slave);
+    setenv("TERM", "xterm", false);
+    execvp(argv[3], argv+3);
+    perror("execvp failed");
+    _exit(127);
+  }
+
+  unsigned long long output = 0;
+  char buffer[65536];
+  while(true){
+    ssize_t n = read(master, buffer, sizeof(buffer));
+    if(n == -1 && errno == EINTR)
+      continue;
+    // EIO once every process closed the pts
+    if(n <= 0)
+      break;
+    output += n;
+  }
+  int status = 0;
+  while(waitpid(pid, &status, 0) == -1 && errno == EINTR);
+  fprintf(stderr, "%s: %llu bytes of output\n", argv[3], output);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Copyright (c) 2018 Daniel Abrecht
+# SPDX-License-Identifier: AGPL-3.0-or-later
+
+# Runs the multiplexer in a pty with bench-keyboard as keyboard and bench-sink as
+# program, once per scenario, and prints the throughput and probe latencies.
+# Usage: bench/run-scenarios.sh [frames [frames per second [scenarios...]]]
+# A rate of 0 sends as fast as possible. Extra multiplexer options can be passed in CKM_BENCH_OPTS,
+# CKM_BENCH_BIN selects another multiplexer binary in bin/, like console-keyboard-multiplexer-null.
+
+frames="${1:-20000}"
+rate="${2:-0}"
+[ $# -gt 2 ] && shift 2 || set -- typing ctrl keys height paste mixed
+
+bin="$(dirname "$0")/../bin"
+multiplexer="${CKM_BENCH_BIN:-console-keyboard-multiplexer}"
+tmp="$(mktemp -d)"
+trap 'rm -rf "$tmp"' EXIT
+
+printf '%-8s %12s %14s %10s %10s %10s\n' scenario frames/s bytes/s p50/ms p99/ms p99.9/ms
+for scenario
+do
+  rm -f "$tmp/keyboard" "$tmp/sink"
+  "$bin/bench-pty-run" 40 120 "$bin/$multiplexer" -u : -v : -w : -m 65536 $CKM_BENCH_OPTS \
+    -k -- "$bin/bench-keyboard" "$scenario" "$frames" "$rate" "$tmp/keyboard" \
+    -- "$bin/bench-sink" "$tmp/sink" 2>"$tmp/log"
+  if [ ! -s "$tmp/keyboard" ] || [ ! -s "$tmp/sink" ]
+  then
+    echo "$scenario: failed" >&2
+    cat "$tmp/log" >&2
+    continue
+  fi
+  # keyboard: start frames bytes, sink: end bytes probes p50 p99 p99.9 max
+  cat "$tmp/keyboard" "$tmp/sink" | tr '\n' ' ' | awk -v scenario="$scenario" '{
+    seconds = ($4 - $1) / 1e9
+    printf "%-8s %12.0f %14.0f %10.3f %10.3f %10.3f\n", scenario, $2 / seconds, $3 / seconds, $7 / 1e6, $8 / 1e6, $9 / 1e6
+  }'
+done
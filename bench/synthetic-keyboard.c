@@ -0,0 +1,190 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+// A keyboard for benchmarks. Instead of showing anything, it sends a fixed mix
+// of commands to the multiplexer on fd 3, as fast as possible or at a fixed rate.
+// Every PROBE_INTERVAL frames, and after the last one, it types a probe "@<time>\r"
+// containing the CLOCK_MONOTONIC time it was sent at, for bench-sink to measure
+// the latency. At the end, it types "@E\r", writes "<start time> <frames> <bytes>"
+// to the result file, and waits until the multiplexer exits.
+// Usage: bench-keyboard scenario frames [frames per second [result file]]
+// Scenarios: typing, ctrl, keys, height, paste, mixed
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <libconsolekeyboard.h>
+#include <ckm_time.h>
+#include <command_reader.h>
+
+#define PROBE_INTERVAL 16
+#define PASTE_SIZE 16384
+// Give the program in the top pane some time to start before sending anything
+#define STARTUP_DELAY_MS 200
+
+enum scenario {
+  SCENARIO_TYPING,
+  SCENARIO_CTRL,
+  SCENARIO_KEYS,
+  SCENARIO_HEIGHT,
+  SCENARIO_PASTE,
+  SCENARIO_MIXED,
+};
+
+static const char* const scenario_names[] = {
+  [SCENARIO_TYPING] = "typing",
+  [SCENARIO_CTRL] = "ctrl",
+  [SCENARIO_KEYS] = "keys",
+  [SCENARIO_HEIGHT] = "height",
+  [SCENARIO_PASTE] = "paste",
+  [SCENARIO_MIXED] = "mixed",
+};
+
+static const char* const key_names[] = {"UP", "DOWN", "LEFT", "RIGHT"};
+
+static size_t max_frame_size = 255;
+static unsigned long long frames, bytes;
+static uint8_t frame[PASTE_SIZE + COMMAND_LONG_FRAME_HEADER_SIZE + 2];
+
+static void send_frame(size_t size){
+  uint8_t* start = frame + COMMAND_LONG_FRAME_HEADER_SIZE - 1;
+  size_t header = 1;
+  if(size > 255){
+    start = frame;
+    header = COMMAND_LONG_FRAME_HEADER_SIZE;
+    frame[0] = 0;
+    for(int i=0; i<4; i++)
+      frame[1+i] = size >> (24 - i * 8);
+  }else{
+    *start = size;
+  }
+  size_t n = header + size;
+  for(size_t i=0; i<n; ){
+    ssize_t ret = write(3, start+i, n-i);
+    if(ret == -1 && errno == EINTR)
+      continue;
+    if(ret == -1){
+      perror("write failed");
+      exit(1);
+    }
+    i += ret;
+  }
+  frames++;
+  bytes += n;
+}
+
+// The payload starts after the space reserved for the biggest header
+static uint8_t* payload(void){
+  return frame + COMMAND_LONG_FRAME_HEADER_SIZE;
+}
+
+static void send_string(bool ctrl, size_t size, const char* string){
+  uint8_t* p = payload();
+  p[0] = LCK_SEND_STRING;
+  p[1] = ctrl ? LCK_MODIFIER_KEY_CTRL : 0;
+  memcpy(p+2, string, size);
+  send_frame(size + 2);
+}
+
+static void send_probe(void){
+  char probe[32];
+  int n = snprintf(probe, sizeof(probe), "@%llu\r", (unsigned long long)ckm_now());
+  send_string(false, n, probe);
+}
+
+static void send_key(const char* name){
+  uint8_t* p = payload();
+  p[0] = LCK_SEND_KEY;
+  size_t n = strlen(name);
+  memcpy(p+1, name, n);
+  send_frame(n + 1);
+}
+
+static void send_height(uint64_t height){
+  uint8_t* p = payload();
+  p[0] = LCK_SET_HEIGHT;
+  for(int i=0; i<8; i++)
+    p[1+i] = height >> (56 - i * 8);
+  send_frame(9);
+}
+
+static void send_paste(void){
+  static char text[PASTE_SIZE];
+  size_t size = max_frame_size - 2 < PASTE_SIZE ? max_frame_size - 2 : PASTE_SIZE;
+  for(size_t i=0; i<size; i++)
+    text[i] = i % 64 == 63 ? '\r' : 'a' + i % 26;
+  send_string(false, size, text);
+}
+
+static void send_one(enum scenario scenario, unsigned long long i){
+  switch(scenario){
+    case SCENARIO_TYPING: {
+      char c = 'a' + i % 26;
+      send_string(false, 1, &c);
+    } break;
+    case SCENARIO_CTRL: send_string(true, 8, "abcdefgh"); break;
+    case SCENARIO_KEYS: send_key(key_names[i % (sizeof(key_names) / sizeof(*key_names))]); break;
+    // Grow to 12 lines and shrink again, like an animation
+    case SCENARIO_HEIGHT: send_height(i % 24 < 12 ? i % 24 : 24 - i % 24); break;
+    case SCENARIO_PASTE: send_paste(); break;
+    case SCENARIO_MIXED: send_one((enum scenario)(i % SCENARIO_MIXED), i / SCENARIO_MIXED); break;
+  }
+}
+
+static void sleep_until(uint64_t t){
+  struct timespec ts = { .tv_sec = t / 1000000000, .tv_nsec = t % 1000000000 };
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
+
+int main(int argc, char* argv[]){
+  if(argc < 3){
+    fprintf(stderr, "Usage: %s scenario frames [frames per second [result file]]\n", argv[0]);
+    return 1;
+  }
+  int scenario = -1;
+  for(size_t i=0; i<sizeof(scenario_names)/sizeof(*scenario_names); i++)
+    if(!strcmp(argv[1], scenario_names[i]))
+      scenario = i;
+  unsigned long long count = strtoull(argv[2], 0, 10);
+  double rate = argc > 3 ? strtod(argv[3], 0) : 0;
+  const char* result = argc > 4 ? argv[4] : 0;
+  if(scenario == -1 || !count){
+    fprintf(stderr, "Unknown scenario or invalid frame count\n");
+    return 1;
+  }
+  const char* max = getenv("TM_MAX_FRAME_SIZE");
+  if(max){
+    max_frame_size = strtoul(max, 0, 10);
+    if(max_frame_size > PASTE_SIZE + 2)
+      max_frame_size = PASTE_SIZE + 2;
+  }
+
+  sleep_until(ckm_now() + STARTUP_DELAY_MS * 1000000ull);
+  uint64_t start = ckm_now();
+  for(unsigned long long i=0; i<count; i++){
+    if(rate > 0)
+      sleep_until(start + i * (1e9 / rate));
+    send_one(scenario, i);
+    if(i % PROBE_INTERVAL == PROBE_INTERVAL - 1)
+      send_probe();
+  }
+  send_probe();
+  send_string(false, 3, "@E\r");
+
+  if(result){
+    FILE* f = fopen(result, "w");
+    if(!f){
+      perror("fopen failed");
+      return 1;
+    }
+    fprintf(f, "%llu %llu %llu\n", (unsigned long long)start, frames, bytes);
+    fclose(f);
+  }
+  // Exiting would make the multiplexer exit before it handled everything
+  while(true)
+    pause();
+}
@@ -0,0 +1,445 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+// A stand-in for the parts of libttymultiplex the multiplexer uses. It's linked
+// into bin/console-keyboard-multiplexer-null before -lttymultiplex, so these
+// definitions take precedence, while logging and the special key list still
+// come from the library. Panes are plain ptys: typed text is written to the
+// master, and whatever the programs output is read and counted by a drain
+// thread, but nothing is ever drawn. Every call is counted, and if
+// TYM_NULL_TRACE names a file, written to it as
+// "<time in ns> <call> <pane> <bytes>". A summary is logged on tym_shutdown.
+// The screen size is taken from stdin if it's a terminal, or TYM_NULL_SIZE
+// ("<rows>x<cols>"), or defaults to 24x80.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <libttymultiplex.h>
+#include <ckm_time.h>
+
+#define TYM_NULL_MAX_PANES 8
+#define WRITE_TIMEOUT_MS 1000
+
+enum tym_null_call {
+  TYM_NULL_INIT,
+  TYM_NULL_FREEZE,
+  TYM_NULL_PANE_CREATE,
+  TYM_NULL_PANE_DESTROY,
+  TYM_NULL_PANE_RESIZE,
+  TYM_NULL_PANE_TYPE,
+  TYM_NULL_PANE_SEND_KEY,
+  TYM_NULL_PANE_SEND_SPECIAL_KEY,
+  TYM_NULL_CALL_COUNT
+};
+
+static const char*const call_name[] = {
+  [TYM_NULL_INIT] = "tym_init",
+  [TYM_NULL_FREEZE] = "tym_freeze",
+  [TYM_NULL_PANE_CREATE] = "tym_pane_create",
+  [TYM_NULL_PANE_DESTROY] = "tym_pane_destroy",
+  [TYM_NULL_PANE_RESIZE] = "tym_pane_resize",
+  [TYM_NULL_PANE_TYPE] = "tym_pane_type",
+  [TYM_NULL_PANE_SEND_KEY] = "tym_pane_send_key",
+  [TYM_NULL_PANE_SEND_SPECIAL_KEY] = "tym_pane_send_special_key",
+};
+
+struct call_stats {
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t first;
+  uint64_t last;
+};
+
+struct null_pane {
+  bool used;
+  int master;
+  int slave;
+  // The last write timed out, don't wait again until the program reads something
+  bool stalled;
+  struct tym_super_position_rectangle position;
+};
+
+static struct null_pane pane_list[TYM_NULL_MAX_PANES];
+static int focus_pane = -1;
+static struct call_stats call_stats[TYM_NULL_CALL_COUNT];
+static FILE* trace;
+static unsigned screen_rows = 24, screen_cols = 80;
+
+static int drain_epoll = -1;
+static int drain_stop = -1;
+static pthread_t drain_thread;
+static bool drain_running;
+// Only touched by the drain thread while it runs
+static uint64_t output_bytes;
+static uint64_t output_reads;
+
+static void record(enum tym_null_call call, int pane, size_t bytes){
+  uint64_t now = ckm_now();
+  struct call_stats* stats = &call_stats[call];
+  if(!stats->calls++)
+    stats->first = now;
+  stats->last = now;
+  stats->bytes += bytes;
+  if(trace)
+    fprintf(trace, "%llu %s %d %zu\n", (unsigned long long)now, call_name[call], pane, bytes);
+}
+
+static struct null_pane* get_pane(int pane){
+  if(pane == TYM_PANE_FOCUS)
+    pane = focus_pane;
+  if(pane < 0 || pane >= TYM_NULL_MAX_PANES || !pane_list[pane].used){
+    errno = EINVAL;
+    return 0;
+  }
+  return &pane_list[pane];
+}
+
+static long edge_position(const struct tym_super_position_rectangle* position, int edge, int axis, unsigned size){
+  double ratio = position->edge[edge].type[TYM_P_RATIO].axis[axis].value.real;
+  long chars = position->edge[edge].type[TYM_P_CHARFIELD].axis[axis].value.integer;
+  long result = (long)(ratio * size) + chars;
+  if(result < 0)
+    return 0;
+  if(result > (long)size)
+    return size;
+  return result;
+}
+
+static int update_size(struct null_pane* pane){
+  long top  = edge_position(&pane->position, TYM_RECT_TOP_LEFT, TYM_AXIS_VERTICAL, screen_rows);
+  long left = edge_position(&pane->position, TYM_RECT_TOP_LEFT, TYM_AXIS_HORIZONTAL, screen_cols);
+  long bottom = edge_position(&pane->position, TYM_RECT_BOTTOM_RIGHT, TYM_AXIS_VERTICAL, screen_rows);
+  long right  = edge_position(&pane->position, TYM_RECT_BOTTOM_RIGHT, TYM_AXIS_HORIZONTAL, screen_cols);
+  struct winsize size = {
+    .ws_row = bottom > top ? bottom - top : 0,
+    .ws_col = right > left ? right - left : 0,
+  };
+  return ioctl(pane->master, TIOCSWINSZ, &size);
+}
+
+static int write_all(struct null_pane* pane, size_t size, const char* data){
+  while(size){
+    ssize_t ret = write(pane->master, data, size);
+    if(ret == -1){
+      if(errno == EINTR)
+        continue;
+      // The master is nonblocking for the drain thread, wait until the program read something,
+      // but not forever, the program may have exited or stopped reading
+      if(errno == EAGAIN){
+        struct pollfd pfd = { .fd = pane->master, .events = POLLOUT };
+        int n = poll(&pfd, 1, pane->stalled ? 0 : WRITE_TIMEOUT_MS);
+        if(n == -1 && errno != EINTR)
+          return -1;
+        if(!n){
+          if(!pane->stalled)
+            TYM_U_LOG(TYM_LOG_WARN, "The program didn't read its input for %dms, dropping input until it does\n", WRITE_TIMEOUT_MS);
+          pane->stalled = true;
+          errno = EAGAIN;
+          return -1;
+        }
+        continue;
+      }
+      return -1;
+    }
+    data += ret;
+    size -= ret;
+  }
+  pane->stalled = false;
+  return 0;
+}
+
+static void* drain(void* ptr){
+  (void)ptr;
+  static char buffer[4096];
+  while(true){
+    struct epoll_event events[TYM_NULL_MAX_PANES + 1];
+    int n = epoll_wait(drain_epoll, events, TYM_NULL_MAX_PANES + 1, -1);
+    if(n == -1){
+      if(errno == EINTR)
+        continue;
+      TYM_U_PERROR(TYM_LOG_ERROR, "epoll_wait failed");
+      return 0;
+    }
+    for(int i=0; i<n; i++){
+      if(events[i].data.fd == drain_stop)
+        return 0;
+      ssize_t ret;
+      while((ret = read(events[i].data.fd, buffer, sizeof(buffer))) > 0){
+        output_bytes += ret;
+        output_reads++;
+      }
+    }
+  }
+}
+
+static void stop_drain(void){
+  if(!drain_running)
+    return;
+  if(eventfd_write(drain_stop, 1) == -1)
+    TYM_U_PERROR(TYM_LOG_ERROR, "eventfd_write failed");
+  pthread_join(drain_thread, 0);
+  eventfd_t value;
+  eventfd_read(drain_stop, &value);
+  drain_running = false;
+}
+
+static void screen_size(void){
+  struct winsize size;
+  if(ioctl(0, TIOCGWINSZ, &size) != -1 && size.ws_row && size.ws_col){
+    screen_rows = size.ws_row;
+    screen_cols = size.ws_col;
+    return;
+  }
+  const char* env = getenv("TYM_NULL_SIZE");
+  unsigned rows, cols;
+  if(env && sscanf(env, "%ux%u", &rows, &cols) == 2 && rows && cols){
+    screen_rows = rows;
+    screen_cols = cols;
+  }
+}
+
+int tym_init(void){
+  if(drain_epoll == -1){
+    screen_size();
+    const char* path = getenv("TYM_NULL_TRACE");
+    if(path && *path && !(trace = fopen(path, "we"))){
+      TYM_U_PERROR(TYM_LOG_ERROR, "fopen failed");
+      return -1;
+    }
+    drain_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(drain_epoll == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "epoll_create1 failed");
+      return -1;
+    }
+    drain_stop = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(drain_stop == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "eventfd failed");
+      return -1;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = drain_stop };
+    if(epoll_ctl(drain_epoll, EPOLL_CTL_ADD, drain_stop, &event) == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "epoll_ctl failed");
+      return -1;
+    }
+  }
+  record(TYM_NULL_INIT, -1, 0);
+  if(drain_running)
+    return 0;
+  if((errno = pthread_create(&drain_thread, 0, drain, 0))){
+    TYM_U_PERROR(TYM_LOG_ERROR, "pthread_create failed");
+    return -1;
+  }
+  drain_running = true;
+  return 0;
+}
+
+int tym_freeze(void){
+  record(TYM_NULL_FREEZE, -1, 0);
+  stop_drain();
+  return 0;
+}
+
+int tym_zap(void){
+  // Called in children, which don't have the drain thread
+  drain_running = false;
+  for(int i=0; i<TYM_NULL_MAX_PANES; i++){
+    if(!pane_list[i].used)
+      continue;
+    close(pane_list[i].master);
+    pane_list[i].used = false;
+  }
+  if(trace){
+    close(fileno(trace));
+    trace = 0;
+  }
+  return 0;
+}
+
+int tym_shutdown(void){
+  stop_drain();
+  for(int i=0; i<TYM_NULL_CALL_COUNT; i++){
+    const struct call_stats* stats = &call_stats[i];
+    if(!stats->calls)
+      continue;
+    double seconds = (stats->last - stats->first) / 1e9;
+    TYM_U_LOG(TYM_LOG_INFO, "%s: %llu calls, %llu bytes, %.3fs between first and last call\n",
+      call_name[i], (unsigned long long)stats->calls, (unsigned long long)stats->bytes, seconds
+    );
+  }
+  TYM_U_LOG(TYM_LOG_INFO, "pane output: %llu bytes in %llu reads\n",
+    (unsigned long long)output_bytes, (unsigned long long)output_reads
+  );
+  for(int i=0; i<TYM_NULL_MAX_PANES; i++)
+    if(pane_list[i].used)
+      tym_pane_destroy(i);
+  if(trace){
+    fclose(trace);
+    trace = 0;
+  }
+  if(drain_stop != -1)
+    close(drain_stop);
+  if(drain_epoll != -1)
+    close(drain_epoll);
+  drain_stop = drain_epoll = -1;
+  return 0;
+}
+
+int tym_pane_create(const struct tym_super_position_rectangle* position){
+  int pane = 0;
+  while(pane < TYM_NULL_MAX_PANES && pane_list[pane].used)
+    pane++;
+  record(TYM_NULL_PANE_CREATE, pane, 0);
+  if(pane >= TYM_NULL_MAX_PANES){
+    errno = ENOMEM;
+    return -1;
+  }
+  struct null_pane* p = &pane_list[pane];
+  p->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if(p->master == -1)
+    return -1;
+  const char* name;
+  if(grantpt(p->master) == -1 || unlockpt(p->master) == -1 || !(name = ptsname(p->master)))
+    goto error;
+  p->slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if(p->slave == -1)
+    goto error;
+  p->position = *position;
+  if(update_size(p) == -1)
+    goto error_slave;
+  int flags = fcntl(p->master, F_GETFL);
+  if(flags == -1 || fcntl(p->master, F_SETFL, flags | O_NONBLOCK) == -1)
+    goto error_slave;
+  struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.fd = p->master };
+  if(epoll_ctl(drain_epoll, EPOLL_CTL_ADD, p->master, &event) == -1)
+    goto error_slave;
+  p->stalled = false;
+  p->used = true;
+  return pane;
+  int error;
+error_slave:
+  error = errno;
+  close(p->slave);
+  errno = error;
+error:
+  error = errno;
+  close(p->master);
+  errno = error;
+  return -1;
+}
+
+int tym_pane_destroy(int pane){
+  record(TYM_NULL_PANE_DESTROY, pane, 0);
+  struct null_pane* p = get_pane(pane);
+  if(!p)
+    return -1;
+  if(drain_epoll != -1)
+    epoll_ctl(drain_epoll, EPOLL_CTL_DEL, p->master, 0);
+  close(p->master);
+  close(p->slave);
+  p->used = false;
+  if(focus_pane == pane)
+    focus_pane = -1;
+  return 0;
+}
+
+int tym_pane_resize(int pane, const struct tym_super_position_rectangle* position){
+  record(TYM_NULL_PANE_RESIZE, pane, 0);
+  struct null_pane* p = get_pane(pane);
+  if(!p)
+    return -1;
+  p->position = *position;
+  return update_size(p);
+}
+
+int tym_pane_set_flag(int pane, enum tym_pane_flag flag, bool status){
+  if(!get_pane(pane))
+    return -1;
+  if(flag == TYM_PF_FOCUS){
+    if(status){
+      focus_pane = pane;
+    }else if(focus_pane == pane){
+      focus_pane = -1;
+    }
+  }
+  return 0;
+}
+
+int tym_pane_get_slavefd(int pane){
+  struct null_pane* p = get_pane(pane);
+  if(!p)
+    return -1;
+  return p->slave;
+}
+
+int tym_pane_get_default_env_vars(int pane, void* ptr, int(*callback)(int pane, void* ptr, size_t count, const char* env[count][2])){
+  if(!get_pane(pane))
+    return -1;
+  const char* env[][2] = {
+    {"TERM", "xterm"},
+  };
+  return callback(pane, ptr, sizeof(env)/sizeof(*env), env);
+}
+
+static int set_env(int pane, void* ptr, size_t count, const char* env[count][2]){
+  (void)pane;
+  (void)ptr;
+  for(size_t i=0; i<count; i++)
+    if(setenv(env[i][0], env[i][1], true) == -1)
+      return -1;
+  return 0;
+}
+
+int tym_pane_set_env(int pane){
+  return tym_pane_get_default_env_vars(pane, 0, set_env);
+}
+
+int tym_pane_type(int pane, size_t size, const char* text){
+  record(TYM_NULL_PANE_TYPE, pane, size);
+  struct null_pane* p = get_pane(pane);
+  if(!p)
+    return -1;
+  return write_all(p, size, text);
+}
+
+int tym_pane_send_key(int pane, int_least16_t key){
+  record(TYM_NULL_PANE_SEND_KEY, pane, 1);
+  struct null_pane* p = get_pane(pane);
+  if(!p)
+    return -1;
+  char c = key & 0xFF;
+  if(key & TYM_KEY_MODIFIER_CTRL)
+    c &= 0x1F;
+  return write_all(p, 1, &c);
+}
+
+// Special keys are only counted, their escape sequences depend on the terminal
+int tym_pane_send_special_key(int pane, int key){
+  record(TYM_NULL_PANE_SEND_SPECIAL_KEY, pane, 0);
+  if(!get_pane(pane))
+    return -1;
+  if(key < 0 || (size_t)key >= tym_special_key_count){
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+int tym_pane_send_special_key_by_name(int pane, const char* name){
+  for(size_t i=0; i<tym_special_key_count; i++)
+    if(tym_special_key_list[i].name && !strcmp(tym_special_key_list[i].name, name))
+      return tym_pane_send_special_key(pane, i);
+  record(TYM_NULL_PANE_SEND_SPECIAL_KEY, pane, 0);
+  errno = EINVAL;
+  return -1;
+}
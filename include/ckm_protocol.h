@@ -0,0 +1,32 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef CKM_PROTOCOL_H
+#define CKM_PROTOCOL_H
+
+/**
+ * Commands understood by the multiplexer in addition to the ones from
+ * libconsolekeyboard, which only uses values below 0x80. Keyboards must only
+ * use them if the corresponding environment variable is set.
+ */
+enum ckm_cmd {
+  /**
+   * Associates a key name with an id, so the key can later be sent using
+   * CKM_SEND_KEY_ID without any name lookup. Payload: 16 bit big endian id, key name.
+   * Available if TM_MAX_KEY_ID is set, ids must be less than its value.
+   * Ids of unknown keys are ignored when sent.
+   */
+  CKM_DEFINE_KEY = 0x80,
+  // Payload: 16 bit big endian id
+  CKM_SEND_KEY_ID = 0x81,
+  /**
+   * Says when the keyboard sent the next command, for measuring the latency until
+   * it's handled. Payload: 64 bit big endian CLOCK_MONOTONIC time in nanoseconds.
+   * Available if TM_TIMESTAMPS is set.
+   */
+  CKM_TIMESTAMP = 0x82,
+};
+
+#define CKM_MAX_KEY_ID 1024
+
+#endif
@@ -0,0 +1,17 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef CKM_TIME_H
+#define CKM_TIME_H
+
+#include <time.h>
+#include <stdint.h>
+
+// Monotonic time in nanoseconds
+static inline uint64_t ckm_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#endif
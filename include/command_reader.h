@@ -0,0 +1,56 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef COMMAND_READER_H
+#define COMMAND_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define COMMAND_READER_BUFFER_SIZE 4096
+#define COMMAND_READER_DEFAULT_MAX_FRAME_SIZE 65536
+
+/**
+ * A frame is either a length byte followed by up to 255 bytes of payload,
+ * or, if long frames are enabled, a 0 byte followed by a 32 bit big endian
+ * length and the payload. Keyboards are told about the maximum frame size
+ * using the TM_MAX_FRAME_SIZE environment variable, they mustn't send long
+ * frames if it isn't set. Frames bigger than that are dropped.
+ */
+#define COMMAND_LONG_FRAME_HEADER_SIZE 5
+
+// Called once per complete frame. frame[size] is always writable and set to 0.
+typedef int(*command_handler_t)(void* ptr, size_t size, uint8_t frame[size+1]);
+
+struct command_reader {
+  // Long frames are disabled if this is 255 or less
+  size_t max_frame_size;
+  size_t start;
+  size_t end;
+  size_t size;
+  size_t discard;
+  bool eof;
+  // Statistics, to check how well frames are batched
+  size_t wakeups;
+  size_t frames;
+  size_t max_frames_per_wakeup;
+  size_t dropped_frames;
+  uint8_t* buffer;
+};
+
+int command_reader_init(struct command_reader* reader, size_t max_frame_size);
+void command_reader_destroy(struct command_reader* reader);
+// Allocates a buffer big enough for the biggest frame now, instead of when it arrives
+int command_reader_reserve(struct command_reader* reader);
+// Reads everything currently available from the non-blocking fd and
+// dispatches every complete frame. Incomplete frames are kept for the next call.
+// Returns the number of dispatched frames, or -1 on error.
+int command_reader_read(struct command_reader* reader, int fd, command_handler_t handler, void* ptr);
+// Same as command_reader_read, but for data which was received some other way.
+// Adds the number of dispatched frames to *count.
+int command_reader_feed(struct command_reader* reader, size_t n, const uint8_t data[n], command_handler_t handler, void* ptr, size_t* count);
+void command_reader_count_wakeup(struct command_reader* reader, size_t count);
+void command_reader_log_stats(const struct command_reader* reader, const char* name);
+
+#endif
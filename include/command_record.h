@@ -0,0 +1,68 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef COMMAND_RECORD_H
+#define COMMAND_RECORD_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Recordings of the keyboard command stream, for replaying them later.
+ * The file starts with the 8 byte magic "CKMREC\0\1", followed by the rows and
+ * columns of the terminal at the start, as 16 bit big endian numbers, or 0 if
+ * unknown. Then, there are records, which each start with the nanoseconds since
+ * the previous record (or the start) as LEB128 number, and a type byte:
+ *  - RECORD_FRAME: LEB128 length, then the frame, as received from the keyboard
+ *  - RECORD_CHILD_EXIT: The child (0: program, 1: keyboard), then the LEB128 wait status + 1, 0 if unknown
+ *  - RECORD_RESIZE: LEB128 keyboard height in characters, once it was applied to the panes
+ * All numbers are unsigned.
+ */
+#define COMMAND_RECORD_MAGIC "CKMREC\0\1"
+
+enum record_type {
+  RECORD_FRAME = 1,
+  RECORD_CHILD_EXIT = 2,
+  RECORD_RESIZE = 3,
+};
+
+struct record {
+  enum record_type type;
+  // Nanoseconds since the start of the recording
+  uint64_t time;
+  // For RECORD_FRAME. data[size] is writable, like for command_handler_t.
+  size_t size;
+  uint8_t* data;
+  // For RECORD_CHILD_EXIT
+  unsigned child;
+  int status;
+  bool has_status;
+  // For RECORD_RESIZE
+  uint64_t height;
+};
+
+int command_record_open(const char* path);
+bool command_record_enabled(void);
+void command_record_frame(size_t size, const uint8_t frame[size]);
+// status is ignored if has_status isn't set
+void command_record_child_exit(unsigned child, bool has_status, int status);
+void command_record_resize(uint64_t height);
+void command_record_close(void);
+
+struct record_reader {
+  FILE* file;
+  uint64_t time;
+  size_t size;
+  uint8_t* buffer;
+  unsigned rows;
+  unsigned columns;
+};
+
+int record_reader_open(struct record_reader* reader, const char* path);
+// Returns 1 if there was a record, 0 at the end of the recording, and -1 on error
+int record_reader_next(struct record_reader* reader, struct record* record);
+void record_reader_close(struct record_reader* reader);
+
+#endif
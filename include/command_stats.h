@@ -0,0 +1,47 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef COMMAND_STATS_H
+#define COMMAND_STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <latency_histogram.h>
+
+/**
+ * Counters and latency histograms per type of keyboard command.
+ *  - queued: From the wakeup of the event loop until the command is dispatched.
+ *            This includes reading it, and handling the commands before it.
+ *  - handled: From dispatching the command until the pane got its input.
+ *  - end_to_end: From the time the keyboard sent the command until the pane got its input.
+ *                Only recorded if the keyboard sent a CKM_TIMESTAMP before the command.
+ * For LCK_SET_HEIGHT, the pane is only resized later, see resize_latency.
+ */
+enum command_type {
+  COMMAND_SEND_KEY,
+  COMMAND_SEND_STRING,
+  COMMAND_SET_HEIGHT,
+  COMMAND_OTHER,
+  COMMAND_TYPE_COUNT
+};
+
+struct command_stats {
+  uint64_t frames;
+  uint64_t bytes;
+  struct latency_histogram queued;
+  struct latency_histogram handled;
+  struct latency_histogram end_to_end;
+};
+
+extern struct command_stats command_stats[COMMAND_TYPE_COUNT];
+extern const char* const command_type_names[COMMAND_TYPE_COUNT];
+
+enum command_type command_type_of(uint8_t cmd);
+// sent is 0 if the keyboard didn't say when it sent the command
+void command_stats_add(uint8_t cmd, size_t size, uint64_t wakeup, uint64_t dispatched, uint64_t done, uint64_t sent);
+void command_stats_reset(void);
+void command_stats_log(void);
+void command_stats_write(FILE* out);
+
+#endif
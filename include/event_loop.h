@@ -0,0 +1,53 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Events which are ready at the same time are handled in this order, so child
+ * exits and keyboard commands don't wait for less urgent sources.
+ * The output of the panes is handled by libttymultiplex, not by this loop.
+ */
+enum event_priority {
+  EVENT_PRIORITY_CHILD,
+  EVENT_PRIORITY_KEYBOARD,
+  EVENT_PRIORITY_DEFAULT,
+  EVENT_PRIORITY_COUNT
+};
+
+struct event_source;
+typedef int(*event_handler_t)(struct event_source* source, uint32_t events);
+
+/**
+ * All sources are edge triggered, handlers need to consume everything available.
+ * EPOLLERR and EPOLLHUP stop the event loop after the handler was called,
+ * unless they are included in events.
+ */
+struct event_source {
+  const char* name;
+  int fd;
+  uint32_t events;
+  enum event_priority priority;
+  event_handler_t handler;
+  void* ptr;
+};
+
+int event_loop_init(void);
+void event_loop_destroy(void);
+int event_loop_add(struct event_source* source);
+int event_loop_remove(struct event_source* source);
+// Waits at most timeout milliseconds for events and handles them. -1 waits forever.
+int event_loop_run_once(int timeout);
+// The time at which the current iteration of the event loop started, see ckm_now
+uint64_t event_loop_wakeup_time(void);
+// How often epoll_wait returned
+uint64_t event_loop_wakeups(void);
+void event_loop_reset_wakeups(void);
+void event_loop_stop(void);
+bool event_loop_stopped(void);
+
+#endif
@@ -0,0 +1,17 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef KEY_TRANSFORM_H
+#define KEY_TRANSFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Replaces the characters at the start of data with the control codes a terminal
+ * sends if they are typed while ctrl is held, up to the first character for which
+ * this isn't just a byte transformation. Returns the number of replaced characters.
+ */
+size_t ctrl_transform(size_t n, uint8_t data[n]);
+
+#endif
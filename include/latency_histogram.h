@@ -0,0 +1,33 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+ * A histogram of durations in nanoseconds. Every power of 2 is split into 8
+ * buckets, so percentiles are accurate to within 12.5%. Adding a value doesn't
+ * allocate anything, which makes it usable on the hot path.
+ */
+#define LATENCY_HISTOGRAM_SUB_BUCKETS 8
+#define LATENCY_HISTOGRAM_BUCKETS (62 * LATENCY_HISTOGRAM_SUB_BUCKETS)
+
+struct latency_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint32_t buckets[LATENCY_HISTOGRAM_BUCKETS];
+};
+
+void latency_histogram_add(struct latency_histogram* histogram, uint64_t ns);
+void latency_histogram_reset(struct latency_histogram* histogram);
+// p is between 0 and 1. Returns the upper bound of the bucket the percentile is in.
+uint64_t latency_histogram_percentile(const struct latency_histogram* histogram, double p);
+void latency_histogram_log(const struct latency_histogram* histogram, const char* name);
+// Writes the histogram as a summary in the prometheus text format. labels may be empty.
+void latency_histogram_write(FILE* out, const struct latency_histogram* histogram, const char* name, const char* labels);
+
+#endif
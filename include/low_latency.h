@@ -0,0 +1,33 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef LOW_LATENCY_H
+#define LOW_LATENCY_H
+
+#include <stdbool.h>
+
+/**
+ * Keeps the multiplexer from being delayed by page faults and other processes.
+ * All memory is locked, including memory allocated later, the stack is faulted
+ * in, and optionally, the scheduling policy, niceness and CPU affinity are changed.
+ * Processes started afterwards don't inherit any of this, the scheduling policy
+ * and a negative niceness are reset on fork by the kernel, and the CPU affinity
+ * and a positive niceness are reset by low_latency_leave, which has to be called
+ * in the new process before it changes its user and calls execve.
+ */
+struct low_latency_options {
+  bool enabled;
+  // SCHED_FIFO priority, 0 to keep the current scheduling policy
+  int rt_priority;
+  bool set_nice;
+  int nice;
+  bool set_cpus;
+};
+
+// Parses a comma separated list of CPUs and ranges, like 0,2-3
+int low_latency_parse_cpus(const char* list);
+int low_latency_enter(const struct low_latency_options* options);
+// Doesn't allocate anything, and can be used between vfork and execve
+void low_latency_leave(void);
+
+#endif
@@ -0,0 +1,54 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef PANE_SPAWN_H
+#define PANE_SPAWN_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Starts a program in a pane without forking the multiplexer. The child shares
+ * our memory until it calls execve (like vfork), so everything it needs is
+ * prepared beforehand, and it doesn't call into libttymultiplex or malloc.
+ * It does what execpane does with execpane_init in the new process: it becomes
+ * a session leader with tty as controlling terminal and as fd 0-2, gets fds at
+ * fd 3 and following, and changes its user & group.
+ */
+struct spawn_options {
+  char** argv;
+  // The complete environment of the new program
+  char** envp;
+  int tty;
+  size_t fd_count;
+  const int* fds;
+  bool change_user;
+  // If this isn't set, failures to change the user are ignored
+  bool change_user_fatal;
+  uid_t uid;
+  gid_t gid;
+  size_t group_count;
+  const gid_t* groups;
+  // Called in the new process before the user is changed. It mustn't allocate memory.
+  void (*prepare)(void);
+};
+
+/**
+ * Returns the pid of the new process, and a pidfd in *pidfd, which may be -1
+ * if the kernel doesn't support CLONE_PIDFD. Returns -1 if the program couldn't
+ * be started, errno is then set to the error which occurred in the new process.
+ */
+pid_t spawn_pane(const struct spawn_options* options, int* pidfd);
+
+struct env_builder {
+  size_t count;
+  char** vars;
+};
+
+int env_builder_init(struct env_builder* env, char* const* vars);
+// Adds or replaces a variable
+int env_builder_set(struct env_builder* env, const char* name, const char* value);
+void env_builder_destroy(struct env_builder* env);
+
+#endif
@@ -0,0 +1,61 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <command_reader.h>
+
+/**
+ * Optional shared memory transport for keyboard commands.
+ *
+ * The multiplexer passes a memfd containing a struct shm_ring to the keyboard,
+ * together with an eventfd used as doorbell. The fd numbers are in the
+ * environment variables TM_SHM_RING_FD and TM_SHM_RING_DOORBELL_FD.
+ * The data area contains the same frames as the command pipe on fd 3.
+ * A keyboard should use either the ring or fd 3, but not both.
+ *
+ * head and tail are free running byte counters, the data area is indexed
+ * modulo size, which is a power of 2. The keyboard is the only writer of head,
+ * the multiplexer the only writer of tail. To send data, the keyboard:
+ *  1. Waits until there is enough space (size - (head - tail)). A frame may
+ *     be written in several parts if it doesn't fit at once.
+ *  2. Copies the data to data[head % size ...], wrapping around at the end.
+ *  3. Stores the new head, sequentially consistent.
+ *  4. Loads tail, sequentially consistent. If it equals the old head, the ring
+ *     was empty, and the keyboard writes 1 to the doorbell eventfd.
+ * After consuming data, the multiplexer stores tail and checks head again
+ * before going to sleep, so no doorbell gets lost.
+ */
+
+#define SHM_RING_MAGIC 0x434B4D52 // "CKMR"
+#define SHM_RING_DEFAULT_SIZE 65536
+
+struct shm_ring {
+  uint32_t magic;
+  uint32_t size;
+  uint8_t reserved_1[56];
+  // Keep head and tail in different cache lines
+  uint32_t head;
+  uint8_t reserved_2[60];
+  uint32_t tail;
+  uint8_t reserved_3[60];
+  uint8_t data[];
+};
+
+struct shm_ring_consumer {
+  int memfd;
+  int doorbell;
+  // Never read the size from the shared memory, the keyboard could change it
+  uint32_t size;
+  uint32_t tail;
+  struct shm_ring* ring;
+};
+
+int shm_ring_create(struct shm_ring_consumer* consumer, uint32_t size);
+void shm_ring_destroy(struct shm_ring_consumer* consumer);
+// Dispatches all frames in the ring. Returns the number of frames, or -1 on error.
+int shm_ring_read(struct shm_ring_consumer* consumer, struct command_reader* reader, command_handler_t handler, void* ptr);
+
+#endif
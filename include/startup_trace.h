@@ -0,0 +1,26 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef STARTUP_TRACE_H
+#define STARTUP_TRACE_H
+
+#include <stdbool.h>
+
+/**
+ * Records when each phase of the startup is reached, until the first keyboard
+ * command arrives. The report has a line per phase, containing the phase name,
+ * the CLOCK_MONOTONIC time in nanoseconds, and the microseconds since the start.
+ * The phases are always recorded, the report is only written if startup_trace_open was called.
+ */
+
+// target is either a file name, or fd:N for an already open file descriptor
+int startup_trace_open(const char* target);
+// The name must be a string literal without whitespace, so the report stays easy to parse.
+// index is appended to the name as [index] unless it's negative
+void startup_trace_point(const char* name, int index);
+// Writes the report and stops tracing
+void startup_trace_report(void);
+// For forked processes which won't continue as the multiplexer
+void startup_trace_abandon(void);
+
+#endif
@@ -0,0 +1,33 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#ifndef STATS_SOCKET_H
+#define STATS_SOCKET_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <event_loop.h>
+
+/**
+ * A unix stream socket for looking at a running multiplexer. Clients send a
+ * single line with a command, or nothing at all, and get a reply after which
+ * the connection is closed. Connections are handled in the event loop, with
+ * the default priority, so they can't delay keyboard commands. Requests
+ * longer than a line are rejected. Connections which didn't send their request
+ * within STATS_SOCKET_TIMEOUT_MS are closed once a new client connects.
+ */
+#define STATS_SOCKET_MAX_REQUEST 64
+#define STATS_SOCKET_MAX_CONNECTIONS 16
+#define STATS_SOCKET_TIMEOUT_MS 1000
+
+// Writes the reply to command to out. An empty command means the default one.
+// Returns -1 if the command is unknown.
+typedef int(*stats_socket_handler_t)(FILE* out, const char* command);
+
+// The socket is created before the event loop exists, and added to it later.
+// It gets mode 0660 and belongs to uid and gid, -1 leaves them unchanged like for chown.
+int stats_socket_open(const char* path, uid_t uid, gid_t gid, stats_socket_handler_t handler);
+int stats_socket_watch(void);
+void stats_socket_close(void);
+
+#endif
@@ -0,0 +1,178 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <libttymultiplex.h>
+#include <command_reader.h>
+
+int command_reader_init(struct command_reader* reader, size_t max_frame_size){
+  memset(reader, 0, sizeof(*reader));
+  reader->max_frame_size = max_frame_size;
+  reader->size = COMMAND_READER_BUFFER_SIZE;
+  // One extra byte so the last frame can always be 0 terminated in place
+  reader->buffer = malloc(reader->size + 1);
+  if(!reader->buffer)
+    return -1;
+  return 0;
+}
+
+void command_reader_destroy(struct command_reader* reader){
+  free(reader->buffer);
+  reader->buffer = 0;
+}
+
+static int grow(struct command_reader* reader, size_t needed){
+  size_t size = reader->size * 2;
+  if(size < needed)
+    size = needed;
+  if(size > reader->max_frame_size + COMMAND_LONG_FRAME_HEADER_SIZE)
+    size = reader->max_frame_size + COMMAND_LONG_FRAME_HEADER_SIZE;
+  if(size < needed){
+    errno = EMSGSIZE;
+    return -1;
+  }
+  uint8_t* buffer = realloc(reader->buffer, size + 1);
+  if(!buffer)
+    return -1;
+  reader->buffer = buffer;
+  reader->size = size;
+  return 0;
+}
+
+int command_reader_reserve(struct command_reader* reader){
+  size_t size = reader->max_frame_size + COMMAND_LONG_FRAME_HEADER_SIZE;
+  if(reader->size >= size)
+    return 0;
+  return grow(reader, size);
+}
+
+// Returns the number of bytes needed for the frame at the start of the buffer if it is incomplete
+static size_t dispatch(struct command_reader* reader, command_handler_t handler, void* ptr, size_t* count){
+  while(true){
+    size_t available = reader->end - reader->start;
+    if(reader->discard){
+      size_t n = reader->discard < available ? reader->discard : available;
+      reader->start += n;
+      reader->discard -= n;
+      available -= n;
+    }
+    if(!available){
+      reader->start = reader->end = 0;
+      return 0;
+    }
+    uint8_t* frame = reader->buffer + reader->start;
+    size_t header = 1;
+    size_t size = *frame;
+    if(!size){
+      if(reader->max_frame_size <= 255){
+        reader->start += 1; // Empty frame
+        continue;
+      }
+      header = COMMAND_LONG_FRAME_HEADER_SIZE;
+      if(available < header)
+        return header;
+      size = (size_t)frame[1] << 24
+           | (size_t)frame[2] << 16
+           | (size_t)frame[3] <<  8
+           | (size_t)frame[4];
+    }
+    // The limit applies to short frames too, it may be below 255
+    if(size > reader->max_frame_size){
+      TYM_U_LOG(TYM_LOG_WARN, "Dropping frame of %zu bytes, the limit is %zu bytes\n", size, reader->max_frame_size);
+      reader->dropped_frames++;
+      reader->start += header;
+      reader->discard = size;
+      continue;
+    }
+    if(available - header < size)
+      return header + size;
+    uint8_t* payload = frame + header;
+    // The byte after the payload may belong to the next frame
+    uint8_t next = payload[size];
+    payload[size] = 0;
+    (*handler)(ptr, size, payload);
+    payload[size] = next;
+    reader->start += header + size;
+    *count += 1;
+  }
+}
+
+// Makes room at the end of the buffer once it is full
+static int make_space(struct command_reader* reader, size_t needed){
+  if(reader->end != reader->size)
+    return 0;
+  // Move the incomplete frame at the end to the start of the buffer
+  memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+  reader->end -= reader->start;
+  reader->start = 0;
+  if(needed > reader->size && grow(reader, needed) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "failed to grow frame buffer");
+    return -1;
+  }
+  return 0;
+}
+
+static void update_stats(struct command_reader* reader, size_t count){
+  reader->wakeups++;
+  reader->frames += count;
+  if(reader->max_frames_per_wakeup < count)
+    reader->max_frames_per_wakeup = count;
+}
+
+int command_reader_read(struct command_reader* reader, int fd, command_handler_t handler, void* ptr){
+  size_t count = 0;
+  size_t needed = 0;
+  while(true){
+    if(make_space(reader, needed) == -1)
+      return -1;
+    ssize_t n = read(fd, reader->buffer + reader->end, reader->size - reader->end);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if(n == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "read failed");
+      return -1;
+    }
+    if(n == 0){
+      reader->eof = true;
+      break;
+    }
+    reader->end += n;
+    needed = dispatch(reader, handler, ptr, &count);
+  }
+  update_stats(reader, count);
+  return count;
+}
+
+int command_reader_feed(struct command_reader* reader, size_t n, const uint8_t data[n], command_handler_t handler, void* ptr, size_t* count){
+  size_t needed = 0;
+  while(n){
+    if(make_space(reader, needed) == -1)
+      return -1;
+    size_t m = reader->size - reader->end;
+    if(m > n)
+      m = n;
+    memcpy(reader->buffer + reader->end, data, m);
+    reader->end += m;
+    data += m;
+    n -= m;
+    needed = dispatch(reader, handler, ptr, count);
+  }
+  return 0;
+}
+
+void command_reader_count_wakeup(struct command_reader* reader, size_t count){
+  update_stats(reader, count);
+}
+
+void command_reader_log_stats(const struct command_reader* reader, const char* name){
+  TYM_U_LOG(TYM_LOG_INFO, "%s: %zu frames in %zu wakeups, %.2f frames per wakeup, at most %zu, %zu dropped\n",
+    name, reader->frames, reader->wakeups,
+    reader->wakeups ? (double)reader->frames / reader->wakeups : 0.,
+    reader->max_frames_per_wakeup, reader->dropped_frames
+  );
+}
@@ -0,0 +1,170 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libttymultiplex.h>
+#include <ckm_time.h>
+#include <command_record.h>
+
+// Frames are buffered, and written once this much was recorded, or when the recording is closed
+#define RECORD_BUFFER_SIZE (64 * 1024)
+// Corrupt recordings mustn't make us allocate arbitrary amounts of memory
+#define RECORD_MAX_FRAME_SIZE (1u << 31)
+
+static FILE* record_file;
+static uint64_t last_time;
+static pid_t owner;
+
+static void put_leb128(uint64_t x){
+  do {
+    uint8_t byte = x & 0x7F;
+    x >>= 7;
+    putc(byte | (x ? 0x80 : 0), record_file);
+  } while(x);
+}
+
+static void put_header(enum record_type type){
+  uint64_t now = ckm_now();
+  put_leb128(now - last_time);
+  last_time = now;
+  putc(type, record_file);
+}
+
+int command_record_open(const char* path){
+  record_file = fopen(path, "we");
+  if(!record_file)
+    return -1;
+  setvbuf(record_file, 0, _IOFBF, RECORD_BUFFER_SIZE);
+  struct winsize size = {0};
+  ioctl(STDIN_FILENO, TIOCGWINSZ, &size);
+  fwrite(COMMAND_RECORD_MAGIC, 1, 8, record_file);
+  const uint8_t header[] = { size.ws_row >> 8, size.ws_row, size.ws_col >> 8, size.ws_col };
+  fwrite(header, 1, sizeof(header), record_file);
+  last_time = ckm_now();
+  owner = getpid();
+  return 0;
+}
+
+bool command_record_enabled(void){
+  return record_file;
+}
+
+void command_record_frame(size_t size, const uint8_t frame[size]){
+  if(!record_file)
+    return;
+  put_header(RECORD_FRAME);
+  put_leb128(size);
+  fwrite(frame, 1, size, record_file);
+}
+
+void command_record_child_exit(unsigned child, bool has_status, int status){
+  if(!record_file)
+    return;
+  put_header(RECORD_CHILD_EXIT);
+  putc(child, record_file);
+  put_leb128(has_status ? (uint64_t)(unsigned)status + 1 : 0);
+}
+
+void command_record_resize(uint64_t height){
+  if(!record_file)
+    return;
+  put_header(RECORD_RESIZE);
+  put_leb128(height);
+}
+
+void command_record_close(void){
+  if(!record_file || getpid() != owner)
+    return;
+  if(fclose(record_file) == EOF)
+    TYM_U_PERROR(TYM_LOG_ERROR, "failed to write the recording");
+  record_file = 0;
+}
+
+int record_reader_open(struct record_reader* reader, const char* path){
+  memset(reader, 0, sizeof(*reader));
+  reader->file = fopen(path, "re");
+  if(!reader->file)
+    return -1;
+  uint8_t header[12];
+  if(fread(header, 1, sizeof(header), reader->file) != sizeof(header) || memcmp(header, COMMAND_RECORD_MAGIC, 8)){
+    fclose(reader->file);
+    reader->file = 0;
+    errno = EINVAL;
+    return -1;
+  }
+  reader->rows = header[8] << 8 | header[9];
+  reader->columns = header[10] << 8 | header[11];
+  return 0;
+}
+
+static int get_leb128(FILE* file, uint64_t* x){
+  *x = 0;
+  for(unsigned shift=0; shift<64; shift+=7){
+    int c = getc(file);
+    if(c == EOF)
+      return -1;
+    *x |= (uint64_t)(c & 0x7F) << shift;
+    if(!(c & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+int record_reader_next(struct record_reader* reader, struct record* record){
+  uint64_t delta;
+  if(get_leb128(reader->file, &delta) == -1)
+    return feof(reader->file) ? 0 : -1;
+  reader->time += delta;
+  memset(record, 0, sizeof(*record));
+  record->time = reader->time;
+  int type = getc(reader->file);
+  uint64_t x;
+  switch(type){
+    case RECORD_FRAME: {
+      if(get_leb128(reader->file, &x) == -1 || x >= RECORD_MAX_FRAME_SIZE)
+        goto invalid;
+      if(reader->size < x + 1){
+        uint8_t* buffer = realloc(reader->buffer, x + 1);
+        if(!buffer)
+          return -1;
+        reader->buffer = buffer;
+        reader->size = x + 1;
+      }
+      if(fread(reader->buffer, 1, x, reader->file) != x)
+        goto invalid;
+      reader->buffer[x] = 0;
+      record->size = x;
+      record->data = reader->buffer;
+    } break;
+    case RECORD_CHILD_EXIT: {
+      int child = getc(reader->file);
+      if(child == EOF || get_leb128(reader->file, &x) == -1)
+        goto invalid;
+      record->child = child;
+      record->has_status = x != 0;
+      record->status = x ? (int)(x - 1) : 0;
+    } break;
+    case RECORD_RESIZE: {
+      if(get_leb128(reader->file, &record->height) == -1)
+        goto invalid;
+    } break;
+    default: goto invalid;
+  }
+  record->type = type;
+  return 1;
+invalid:
+  TYM_U_LOG(TYM_LOG_ERROR, "The recording is truncated or invalid\n");
+  errno = EINVAL;
+  return -1;
+}
+
+void record_reader_close(struct record_reader* reader){
+  if(reader->file)
+    fclose(reader->file);
+  free(reader->buffer);
+  memset(reader, 0, sizeof(*reader));
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include <stdio.h>
+#include <string.h>
+#include <libttymultiplex.h>
+#include <libconsolekeyboard.h>
+#include <ckm_protocol.h>
+#include <command_stats.h>
+
+struct command_stats command_stats[COMMAND_TYPE_COUNT];
+
+const char* const command_type_names[COMMAND_TYPE_COUNT] = {
+  [COMMAND_SEND_KEY] = "send_key",
+  [COMMAND_SEND_STRING] = "send_string",
+  [COMMAND_SET_HEIGHT] = "set_height",
+  [COMMAND_OTHER] = "other",
+};
+
+enum command_type command_type_of(uint8_t cmd){
+  switch((int)cmd){
+    case LCK_SEND_KEY: return COMMAND_SEND_KEY;
+    case CKM_SEND_KEY_ID: return COMMAND_SEND_KEY;
+    case LCK_SEND_STRING: return COMMAND_SEND_STRING;
+    case LCK_SET_HEIGHT: return COMMAND_SET_HEIGHT;
+  }
+  return COMMAND_OTHER;
+}
+
+void command_stats_add(uint8_t cmd, size_t size, uint64_t wakeup, uint64_t dispatched, uint64_t done, uint64_t sent){
+  struct command_stats* stats = &command_stats[command_type_of(cmd)];
+  stats->frames++;
+  stats->bytes += size;
+  if(wakeup && wakeup <= dispatched)
+    latency_histogram_add(&stats->queued, dispatched - wakeup);
+  latency_histogram_add(&stats->handled, done - dispatched);
+  if(sent && sent <= done)
+    latency_histogram_add(&stats->end_to_end, done - sent);
+}
+
+void command_stats_reset(void){
+  memset(command_stats, 0, sizeof(command_stats));
+}
+
+void command_stats_log(void){
+  for(int i=0; i<COMMAND_TYPE_COUNT; i++){
+    const struct command_stats* stats = &command_stats[i];
+    if(!stats->frames)
+      continue;
+    char name[64];
+    TYM_U_LOG(TYM_LOG_INFO, "%s: %llu frames, %llu bytes\n", command_type_names[i],
+      (unsigned long long)stats->frames, (unsigned long long)stats->bytes);
+    snprintf(name, sizeof(name), "%s queued", command_type_names[i]);
+    latency_histogram_log(&stats->queued, name);
+    snprintf(name, sizeof(name), "%s handled", command_type_names[i]);
+    latency_histogram_log(&stats->handled, name);
+    if(stats->end_to_end.count){
+      snprintf(name, sizeof(name), "%s end to end", command_type_names[i]);
+      latency_histogram_log(&stats->end_to_end, name);
+    }
+  }
+}
+
+void command_stats_write(FILE* out){
+  static const char* const stages[] = {"queued", "handled", "end_to_end"};
+  for(int i=0; i<COMMAND_TYPE_COUNT; i++){
+    fprintf(out, "ckm_command_frames_total{type=\"%s\"} %llu\n", command_type_names[i], (unsigned long long)command_stats[i].frames);
+    fprintf(out, "ckm_command_bytes_total{type=\"%s\"} %llu\n", command_type_names[i], (unsigned long long)command_stats[i].bytes);
+  }
+  for(int i=0; i<COMMAND_TYPE_COUNT; i++){
+    const struct latency_histogram* histograms[] = {&command_stats[i].queued, &command_stats[i].handled, &command_stats[i].end_to_end};
+    for(int j=0; j<3; j++){
+      char labels[64];
+      snprintf(labels, sizeof(labels), "type=\"%s\",stage=\"%s\"", command_type_names[i], stages[j]);
+      latency_histogram_write(out, histograms[j], "ckm_command_latency_seconds", labels);
+    }
+  }
+}
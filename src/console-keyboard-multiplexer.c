@@ -8,12 +8,16 @@
 #include <sys/prctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <execinfo.h>
 #include <pwd.h>
 #include <grp.h>
 #include <utmp.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -22,9 +26,25 @@
 #include <string.h>
 #include <ctype.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <getopt.h>
 #include <libttymultiplex.h>
 #include <libconsolekeyboard.h>
+#include <ckm_protocol.h>
+#include <ckm_time.h>
+#include <command_reader.h>
+#include <event_loop.h>
+#include <key_transform.h>
+#include <shm_ring.h>
+#include <pane_spawn.h>
+#include <startup_trace.h>
+#include <low_latency.h>
+#include <latency_histogram.h>
+#include <command_stats.h>
+#include <stats_socket.h>
+#include <command_record.h>
+#include <sys/timerfd.h>
+#include <linux/capability.h>
 
 int top_pane = -1;
 struct tym_super_position_rectangle top_pane_coordinates = {
@@ -45,7 +65,33 @@ struct tym_super_position_rectangle bottom_pane_coordinates = {
   }
 };
 
+// A keyboard started in advance, in a pane without any height, see start_standby_keyboard
+int standby_pane = -1;
+struct tym_super_position_rectangle standby_pane_coordinates = {
+  .edge[TYM_RECT_TOP_LEFT].type[TYM_P_RATIO].axis = {
+    [TYM_AXIS_VERTICAL].value.real = 1,
+  },
+  .edge[TYM_RECT_BOTTOM_RIGHT].type[TYM_P_RATIO].axis = {
+    [TYM_AXIS_HORIZONTAL].value.real = 1,
+    [TYM_AXIS_VERTICAL].value.real = 1,
+  }
+};
+
+unsigned long resizes_requested = 0;
+unsigned long resizes_applied = 0;
+long keyboard_height = 0;
+
 void set_keyboard_size(struct lck_super_size size){
+  static bool initialised = false;
+  static struct lck_super_size current;
+  if(initialised && current.character == size.character)
+    return;
+  initialised = true;
+  current = size;
+  keyboard_height = size.character;
+  command_record_resize(size.character);
+  if(top_pane != -1 || bottom_pane != -1)
+    resizes_applied++;
   TYM_RECT_POS_REF(top_pane_coordinates, CHARFIELD, TYM_BOTTOM) = -size.character;
   TYM_RECT_POS_REF(bottom_pane_coordinates, CHARFIELD, TYM_TOP) = -size.character;
   if(top_pane != -1){
@@ -77,16 +123,35 @@ struct ckm_args {
   struct user_group keyboard_user;
   struct user_group program_user;
   bool has_keyboard;
+  bool inline_tty_cleanup;
+  bool respawn;
+  bool standby_keyboard;
   char* ttyname;
   char** keyboard;
+  char* startup_trace;
+  size_t max_frame_size;
+  uint32_t shm_ring_size;
+  unsigned resize_delay;
+  struct low_latency_options low_latency;
+  char* stats_socket_dir;
+  char* record;
+  char* replay;
+  bool replay_fast;
 };
 
 #define NOBODY  65534
 #define NOGROUP 65534
 
+static struct shm_ring_consumer keyboard_ring = {
+  .memfd = -1,
+  .doorbell = -1,
+};
+
 static struct ckm_args args = {
   .help = false,
   .print_fd = -1,
+  .max_frame_size = COMMAND_READER_DEFAULT_MAX_FRAME_SIZE,
+  .resize_delay = 16,
   .keyboard = (char*[]){(char[]){"console-keyboard"},0},
   .main_user     = {NOBODY, NOGROUP, false},
   .keyboard_user = {NOBODY, NOGROUP, false},
@@ -94,6 +159,9 @@ static struct ckm_args args = {
 };
 
 void cleanup(void){
+  stats_socket_close();
+  command_record_close();
+  startup_trace_report();
   tym_shutdown();
 }
 
@@ -113,7 +181,10 @@ int blockreadchar(int fd){
   }
 }
 
-int execpane(void* ptr, size_t setup_count, execpane_setup_t setup[setup_count], char* args[], int cfd, bool inverse){
+void forget_termination_signals(void);
+
+// The fds are passed to the new program as fd 3 and following
+int execpane(void* ptr, size_t setup_count, execpane_setup_t setup[setup_count], char* args[], size_t fd_count, const int fds[fd_count], bool inverse){
   pid_t oldpid = getpid();
 
   int endpipe[2];
@@ -158,6 +229,7 @@ int execpane(void* ptr, size_t setup_count, execpane_setup_t setup[setup_count],
   pid_t newpid = fork();
   if(newpid == -1)
     return -1;
+  startup_trace_point("execpane_fork", -1);
 
   pid_t result = 0;
   pid_t prog_pid = 0;
@@ -197,6 +269,7 @@ int execpane(void* ptr, size_t setup_count, execpane_setup_t setup[setup_count],
         if(ret == -1)
           goto getresult_oldproc;
       }
+      startup_trace_point("execpane_handshake", i);
       while( write(sync_ab[1], (char[]){1}, 1) == -1 && errno == EINTR );
     }
     int ret = blockreadchar(sync_ba[0]);
@@ -209,6 +282,10 @@ int execpane(void* ptr, size_t setup_count, execpane_setup_t setup[setup_count],
     goto getresult_oldproc;
   }
 
+  startup_trace_abandon();
+  forget_termination_signals();
+  signal(SIGUSR1, SIG_DFL);
+  low_latency_leave();
   close(endpipe[0]);
   close(sync_ba[0]);
   close(sync_ab[1]);
@@ -236,10 +313,17 @@ int execpane(void* ptr, size_t setup_count, execpane_setup_t setup[setup_count],
 
   tym_zap();
 
-  if(cfd > 0){
-    dup2(cfd, 3);
-    if(cfd != 3)
-      close(cfd);
+  if(fd_count){
+    // Move the fds out of the way first, they may overlap with the target fds
+    int tmp[fd_count];
+    for(size_t i=0; i<fd_count; i++)
+      tmp[i] = fcntl(fds[i], F_DUPFD, 3 + fd_count);
+    for(size_t i=0; i<fd_count; i++)
+      close(fds[i]);
+    for(size_t i=0; i<fd_count; i++){
+      dup2(tmp[i], 3 + i);
+      close(tmp[i]);
+    }
   }
 
   execvp(args[0], args);
@@ -268,17 +352,51 @@ getresult_oldproc:;
   return result;
 }
 
+typedef int(*setenv_t)(void* ptr, const char* name, const char* value);
+
+// The environment variables set by the multiplexer itself, in addition to the ones from libttymultiplex
+int set_pane_env(int pane, pid_t main_pid, setenv_t set, void* ptr){
+  char buf[64] = {0};
+  sprintf(buf, "%ld", (long)main_pid);
+  if((*set)(ptr, "TM_PID", buf) == -1)
+    return -1;
+  bool keyboard = pane == bottom_pane || pane == standby_pane;
+  if(keyboard && args.max_frame_size > 255){
+    sprintf(buf, "%zu", args.max_frame_size);
+    if((*set)(ptr, "TM_MAX_FRAME_SIZE", buf) == -1)
+      return -1;
+  }
+  if(keyboard){
+    sprintf(buf, "%d", CKM_MAX_KEY_ID);
+    if((*set)(ptr, "TM_MAX_KEY_ID", buf) == -1)
+      return -1;
+    if((*set)(ptr, "TM_TIMESTAMPS", "1") == -1)
+      return -1;
+  }
+  if(pane == bottom_pane && keyboard_ring.ring){
+    if((*set)(ptr, "TM_SHM_RING_FD", "4") == -1)
+      return -1;
+    if((*set)(ptr, "TM_SHM_RING_DOORBELL_FD", "5") == -1)
+      return -1;
+  }
+  return 0;
+}
+
+static int set_process_env(void* ptr, const char* name, const char* value){
+  (void)ptr;
+  return setenv(name, value, true);
+}
+
 int execpane_init(void* ptr, pid_t main_pid, pid_t prog_pid){
   (void)prog_pid;
   int pane = *(int*)ptr;
   if(tym_pane_set_env(pane) == -1)
     return -1;
-  char buf[64] = {0};
-  sprintf(buf, "%ld", (long)main_pid);
-  setenv("TM_PID", buf, true);
+  if(set_pane_env(pane, main_pid, set_process_env, 0) == -1)
+    return -1;
   struct user_group ug = pane == top_pane ? args.program_user : args.keyboard_user;
   if(!ug.ignore){
-    bool fatal = getpid() == 0;
+    bool fatal = getuid() == 0;
     if(setgid(ug.group) == -1){
       TYM_U_PERROR(fatal ? TYM_LOG_ERROR : TYM_LOG_WARN, "setgid failed");
       if(fatal)
@@ -298,100 +416,159 @@ int execpane_init(void* ptr, pid_t main_pid, pid_t prog_pid){
   return 0;
 }
 
-bool is_session_leader = false;
-bool waithup = false;
-bool gothup = false;
-void hupwaiter(int signo){
-  (void)signo;
-  gothup = true;
-  waithup = false;
+/**
+ * In retain pid mode, the program gives up its controlling terminal in execpane_init,
+ * which sends a SIGHUP to the foreground process group, and may take the terminal away from us.
+ * The program ignores the SIGHUP until it's done, we block it and consume it afterwards. Since the
+ * program only continues with the handshake after it gave up the terminal, the SIGHUP is already
+ * pending once execpane_takeover_tty2 runs, there is no need to wait for it.
+ */
+static uint64_t takeover_start;
+static struct sigaction program_sighup_action;
+
+static void takeover_phase(const char* phase){
+  startup_trace_point(phase, -1);
+  TYM_U_LOG(TYM_LOG_DEBUG, "tty takeover: %s after %.3fms\n", phase, (ckm_now() - takeover_start) / 1e6);
+}
+
+int execpane_ignore_hup(void* ptr, pid_t main_pid, pid_t prog_pid){
+  (void)ptr;
+  (void)prog_pid;
+  (void)main_pid;
+  if(sigaction(SIGHUP, &(struct sigaction){.sa_handler=SIG_IGN}, &program_sighup_action) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "sigaction failed");
+    return -1;
+  }
+  return 0;
+}
+
+int execpane_restore_hup(void* ptr, pid_t main_pid, pid_t prog_pid){
+  (void)ptr;
+  (void)prog_pid;
+  (void)main_pid;
+  if(sigaction(SIGHUP, &program_sighup_action, 0) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "sigaction failed");
+    return -1;
+  }
+  return 0;
 }
 
 int execpane_takeover_tty(void* ptr, pid_t main_pid, pid_t prog_pid){
   (void)ptr;
   (void)prog_pid;
   (void)main_pid;
-  if(getpid() != getpgid(0)){
-    if(setpgid(0,0) == -1){
-      TYM_U_PERROR(TYM_LOG_ERROR, "setpgid failed: %s");
-      return -1;
-    }
+  takeover_start = ckm_now();
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  if(sigprocmask(SIG_BLOCK, &set, 0) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "sigprocmask failed");
+    return -1;
   }
   signal(SIGTTOU, SIG_IGN);
   signal(SIGTTIN, SIG_IGN);
-  if(tcsetpgrp(STDIN_FILENO,getpid()) == -1){
-    TYM_U_PERROR(TYM_LOG_ERROR, "tcsetpgrp failed: %s");
+  // Stay in the process group of the program, so we won't be a process group leader
+  // and can call setsid later without having to change our process group first.
+  if(tcsetpgrp(STDIN_FILENO, getpgrp()) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "tcsetpgrp failed");
+    return -1;
+  }
+  takeover_phase("takeover_sighup_blocked");
+  return 0;
+}
+
+// Fallback in case we are a process group leader after all, setsid would fail otherwise.
+static int leave_process_group(void){
+  // Make a new process group using a child process, and join it.
+  int waitpipe[2];
+  if(pipe(waitpipe) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "pipe failed");
     return -1;
   }
-  if(is_session_leader){
-    waithup = true;
-    signal(SIGHUP, hupwaiter);
+  int ret = fork();
+  if(ret == -1){
+    close(waitpipe[0]);
+    close(waitpipe[1]);
+    TYM_U_PERROR(TYM_LOG_ERROR, "fork failed");
+    return -1;
   }
+  if(!ret){
+    close(waitpipe[0]);
+    setpgid(0,0); // Make a new process group
+    close(waitpipe[1]); // signal old process
+    while(true)
+      pause();
+    exit(1);
+  }
+  close(waitpipe[1]);
+  blockreadchar(waitpipe[0]); // wait until the other process is ready
+  close(waitpipe[0]);
+  if(setpgid(0,ret) == -1){ // Switch to new process group of other process
+    TYM_U_PERROR(TYM_LOG_ERROR, "setpgid failed");
+    kill(ret, SIGKILL);
+    return -1;
+  }
+  kill(ret, SIGKILL);
+  while(waitpid(ret,0,0) == -1 && errno == EINTR);
   return 0;
 }
 
 // We may have lost our controling terminal in the mean time. Reclaim it if so.
 int execpane_takeover_tty2(void* ptr, pid_t main_pid, pid_t prog_pid){
+  (void)ptr;
   (void)prog_pid;
   (void)main_pid;
-  // Wait about 2 seconds for the sighup signal, if it didn't arrive already
-  for(int i=0; waithup && i < 2 * 10; i++)
-    usleep(100000);
-  if(gothup){
-    gothup = false;
-    signal(SIGHUP, SIG_DFL); // reset signal handler
-  }
-  if(open("/dev/tty", O_RDONLY) == -1){
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  if(sigtimedwait(&set, 0, &(struct timespec){0}) == SIGHUP)
+    takeover_phase("takeover_sighup_consumed");
+  int fd = open("/dev/tty", O_RDONLY|O_CLOEXEC);
+  if(fd != -1){
+    close(fd);
+  }else{
     if(errno != ENXIO){
-      TYM_U_PERROR(TYM_LOG_ERROR, "open failed: %s");
+      TYM_U_PERROR(TYM_LOG_ERROR, "open failed");
       return -1;
     }
     // OK, we lost the tty. This means the original process, whose content shall
     // be redirected to the top pane, had to give up the current terminal to gain
     // a new one, which caused this process to loose the controling terminal (and to get a sighup).
-    // We need to become the new session leader. But to do so, we first need to change our process
-    // group to something else than ours, or setsid will fail.
-    int waitpipe[2];
-    if(pipe(waitpipe) == -1){
-      TYM_U_PERROR(TYM_LOG_ERROR, "pipe failed: %s");
-      return -1;
+    // We need to become the new session leader.
+    int ret = setsid();
+    if(ret == -1 && errno == EPERM){
+      if(leave_process_group() == -1)
+        return -1;
+      ret = setsid();
     }
-    int ret = fork();
     if(ret == -1){
-      close(waitpipe[0]);
-      close(waitpipe[1]);
-      TYM_U_PERROR(TYM_LOG_ERROR, "fork failed: %s");
+      TYM_U_PERROR(TYM_LOG_ERROR, "setsid failed");
       return -1;
     }
-    if(!ret){
-      close(waitpipe[0]);
-      setpgid(0,0); // Make a new process group
-      close(waitpipe[1]); // signal old process
-      while(true)
-        pause();
-      exit(1);
-    }else{
-      close(waitpipe[1]);
-      blockreadchar(waitpipe[0]); // wait until the other process is ready
-      close(waitpipe[0]);
-      if(setpgid(0,ret) == -1){ // Switch to new process group of other process
-        TYM_U_PERROR(TYM_LOG_ERROR, "setpgid failed: %s");
-        kill(ret, SIGKILL);
-        return -1;
-      }
-      kill(ret, SIGKILL);
-      while(waitpid(ret,0,0) == -1 && errno == EINTR);
-    }
-    if(setsid() == -1){ // Now, getpid() != getpgid(0), now setsid should work.
-      TYM_U_PERROR(TYM_LOG_ERROR, "setsid failed: %s");
+    takeover_phase("takeover_new_session");
+    if(ioctl(STDIN_FILENO, TIOCSCTTY, 0) == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "ioctl(STDIN_FILENO, TIOCSCTTY, 0) failed");
       return -1;
     }
-    if(ioctl(STDIN_FILENO, TIOCSCTTY, 0) == -1){
-      TYM_U_PERROR(TYM_LOG_ERROR, "ioctl(STDIN_FILENO, TIOCSCTTY, 0) failed: %s");
+    takeover_phase("takeover_ctty_reclaimed");
+  }
+  if(getpid() != getpgid(0)){
+    if(setpgid(0,0) == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "setpgid failed");
       return -1;
     }
   }
-  return execpane_takeover_tty(ptr, main_pid, prog_pid);
+  if(tcsetpgrp(STDIN_FILENO, getpid()) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "tcsetpgrp failed");
+    return -1;
+  }
+  // A SIGHUP after this is a real hangup
+  if(sigprocmask(SIG_UNBLOCK, &set, 0) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "sigprocmask failed");
+    return -1;
+  }
+  takeover_phase("takeover_done");
+  return 0;
 }
 
 uint64_t bytes_to_uint64(uint8_t in[8]){
@@ -407,13 +584,98 @@ uint64_t bytes_to_uint64(uint8_t in[8]){
   return x;
 }
 
+// Index of the special key + 1, 0 if undefined
+static uint_least16_t special_key_by_id[CKM_MAX_KEY_ID];
+
+int define_special_key(unsigned id, const char* name){
+  if(id >= CKM_MAX_KEY_ID){
+    errno = EINVAL;
+    return -1;
+  }
+  special_key_by_id[id] = 0;
+  for(size_t i=0; i<tym_special_key_count; i++){
+    if(!tym_special_key_list[i].name || strcmp(tym_special_key_list[i].name, name))
+      continue;
+    special_key_by_id[id] = i + 1;
+    return 0;
+  }
+  TYM_U_LOG(TYM_LOG_WARN, "Unknown special key \"%s\"\n", name);
+  errno = ENOENT;
+  return -1;
+}
+
+/**
+ * Keyboards may change their height many times in a short time, for example
+ * when animating. The height is only applied once the keyboard didn't request
+ * another one for resize_delay milliseconds, so the programs only have to redraw
+ * once it settled. To still follow long animations, the panes are resized at the
+ * latest RESIZE_MAX_DELAY_FACTOR times resize_delay after the first request.
+ */
+#define RESIZE_MAX_DELAY_FACTOR 4
+
+bool keyboard_size_pending = false;
+struct lck_super_size pending_keyboard_size;
+uint64_t keyboard_size_deadline;
+uint64_t keyboard_size_requested;
+// From the first height requested until the panes were resized
+struct latency_histogram resize_latency;
+
+void request_keyboard_size(struct lck_super_size size){
+  resizes_requested++;
+  pending_keyboard_size = size;
+  if(!args.resize_delay){
+    set_keyboard_size(size);
+    return;
+  }
+  uint64_t now = ckm_now();
+  if(!keyboard_size_pending){
+    keyboard_size_pending = true;
+    keyboard_size_requested = now;
+  }
+  keyboard_size_deadline = now + args.resize_delay * 1000000ull;
+  uint64_t latest = keyboard_size_requested + RESIZE_MAX_DELAY_FACTOR * args.resize_delay * 1000000ull;
+  if(keyboard_size_deadline > latest)
+    keyboard_size_deadline = latest;
+}
+
+// The poll timeout until the pending keyboard size has to be applied
+int keyboard_size_timeout(void){
+  if(!keyboard_size_pending)
+    return -1;
+  uint64_t now = ckm_now();
+  if(now >= keyboard_size_deadline)
+    return 0;
+  return (keyboard_size_deadline - now + 999999) / 1000000;
+}
+
+void apply_pending_keyboard_size(void){
+  if(!keyboard_size_pending || ckm_now() < keyboard_size_deadline)
+    return;
+  keyboard_size_pending = false;
+  set_keyboard_size(pending_keyboard_size);
+  latency_histogram_add(&resize_latency, ckm_now() - keyboard_size_requested);
+}
+
 int parse(size_t s, uint8_t b[s+1]){
   if(s < 1)
     return -1;
   enum lck_cmd cmd = *b;
   b += 1;
   s -= 1;
-  switch(cmd){
+  switch((int)cmd){
+    case CKM_SEND_KEY_ID: {
+      if(s < 2)
+        return -1;
+      unsigned id = (unsigned)b[0] << 8 | b[1];
+      if(id >= CKM_MAX_KEY_ID || !special_key_by_id[id])
+        return -1;
+      return tym_pane_send_special_key(TYM_PANE_FOCUS, special_key_by_id[id] - 1);
+    }
+    case CKM_DEFINE_KEY: {
+      if(s < 3)
+        return -1;
+      return define_special_key((unsigned)b[0] << 8 | b[1], (char*)b+2);
+    }
     case LCK_SEND_KEY   : return tym_pane_send_special_key_by_name(TYM_PANE_FOCUS, (char*)b);
     case LCK_SEND_STRING: {
       if(s < 2)
@@ -422,8 +684,15 @@ int parse(size_t s, uint8_t b[s+1]){
       b++, s--;
       if(!modifiers)
         return tym_pane_type(TYM_PANE_FOCUS, s, (char*)b);
-      for(size_t i=0; i<s; i++){
-        uint_least16_t key = b[i];
+      for(size_t i=0; i<s; ){
+        // Send as much as possible at once, only keys without a plain control code are sent one by one
+        size_t n = ctrl_transform(s-i, b+i);
+        if(n){
+          tym_pane_type(TYM_PANE_FOCUS, n, (char*)b+i);
+          i += n;
+          continue;
+        }
+        uint_least16_t key = b[i++];
         if(modifiers & LCK_MODIFIER_KEY_CTRL)
           key |= TYM_KEY_MODIFIER_CTRL;
         tym_pane_send_key(TYM_PANE_FOCUS, key);
@@ -433,13 +702,51 @@ int parse(size_t s, uint8_t b[s+1]){
       struct lck_super_size size;
       memset(&size, 0, sizeof(size));
       if(s >= 8) size.character = bytes_to_uint64(b);
-      set_keyboard_size(size);
+      request_keyboard_size(size);
     }; return 0;
     default: return -1;
   }
   return 0;
 }
 
+// Keyboard commands should be handled within this many milliseconds after the event loop woke up
+#define KEYBOARD_DEADLINE_MS 10
+
+uint64_t keyboard_max_delay = 0;
+unsigned long keyboard_deadline_misses = 0;
+// From the wakeup of the event loop until the command was handled, and the pane got its input
+struct latency_histogram keyboard_latency;
+// When the keyboard sent the current command, if it told us using CKM_TIMESTAMP
+static uint64_t keyboard_send_time = 0;
+
+int parse_command(void* ptr, size_t s, uint8_t b[s+1]){
+  (void)ptr;
+  command_record_frame(s, b);
+  static bool first = true;
+  if(first){
+    first = false;
+    startup_trace_point("first_keyboard_frame", -1);
+    startup_trace_report();
+  }
+  if(s >= 1 && b[0] == CKM_TIMESTAMP){
+    keyboard_send_time = s >= 9 ? bytes_to_uint64(b+1) : 0;
+    return 0;
+  }
+  uint8_t cmd = s ? b[0] : 0;
+  uint64_t dispatched = ckm_now();
+  int ret = parse(s, b);
+  uint64_t done = ckm_now();
+  uint64_t delay = done - event_loop_wakeup_time();
+  command_stats_add(cmd, s, event_loop_wakeup_time(), dispatched, done, keyboard_send_time);
+  keyboard_send_time = 0;
+  latency_histogram_add(&keyboard_latency, delay);
+  if(keyboard_max_delay < delay)
+    keyboard_max_delay = delay;
+  if(delay > KEYBOARD_DEADLINE_MS * 1000000ull)
+    keyboard_deadline_misses++;
+  return ret;
+}
+
 void trim(char** pstr){
   if(!pstr || !*pstr)
     return;
@@ -548,11 +855,26 @@ int parseopts(int* pargc, char*** pargv){
       {"program-user"  , required_argument, 0,  'w'},
       {"ttyname"       , required_argument, 0,  'l'},
       {"keyboard"      , no_argument, 0,  'k'},
+      {"max-frame-size", required_argument, 0,  'm'},
+      {"shm-ring"      , required_argument, 0,  's'},
+      {"resize-delay"  , required_argument, 0,  'd'},
+      {"startup-trace" , required_argument, 0,  't'},
+      {"inline-tty-cleanup", no_argument, 0,  'L'},
+      {"respawn"       , no_argument, 0,  'R'},
+      {"standby-keyboard", no_argument, 0,  'z'},
+      {"low-latency"   , no_argument, 0,  'F'},
+      {"rt-priority"   , required_argument, 0,  'P'},
+      {"nice"          , required_argument, 0,  'n'},
+      {"cpu-affinity"  , required_argument, 0,  'c'},
+      {"stats-socket"  , required_argument, 0,  'S'},
+      {"record"        , required_argument, 0,  'o'},
+      {"replay"        , required_argument, 0,  'i'},
+      {"replay-fast"   , no_argument, 0,  'x'},
       {0, 0, 0, 0}
   };
 
   int c;
-  while((c = getopt_long(opt_argc, argv, "hrkp:u:v:w:l:", long_options, 0)) != -1){
+  while((c = getopt_long(opt_argc, argv, "hrkLRzFxp:P:n:c:S:o:i:u:v:w:l:m:s:d:t:", long_options, 0)) != -1){
     switch (c){
       case 'h': args.help = true; return 0;
       case 'r': args.retain_pid = true; break;
@@ -568,6 +890,71 @@ int parseopts(int* pargc, char*** pargv){
         }
         args.print_fd = fd;
       } break;
+      case 'm': {
+        char* end = 0;
+        errno = 0;
+        unsigned long long size = strtoull(optarg, &end, 10);
+        if(errno || *end || !*optarg || size > UINT32_MAX || (size_t)size != size){
+          errno = EINVAL;
+          return -1;
+        }
+        args.max_frame_size = size;
+      } break;
+      case 's': {
+        char* end = 0;
+        errno = 0;
+        unsigned long size = strtoul(optarg, &end, 10);
+        if(errno || *end || size < 256 || size > UINT32_MAX / 2 || (size & (size - 1))){
+          errno = EINVAL;
+          return -1;
+        }
+        args.shm_ring_size = size;
+      } break;
+      case 't': args.startup_trace = optarg; break;
+      case 'L': args.inline_tty_cleanup = true; break;
+      case 'R': args.respawn = true; break;
+      case 'z': args.standby_keyboard = true; break;
+      case 'F': args.low_latency.enabled = true; break;
+      case 'S': args.stats_socket_dir = optarg; break;
+      case 'o': args.record = optarg; break;
+      case 'i': args.replay = optarg; break;
+      case 'x': args.replay_fast = true; break;
+      case 'P': {
+        char* end = 0;
+        errno = 0;
+        long priority = strtol(optarg, &end, 10);
+        if(errno || *end || !*optarg || priority < 1 || priority > 99){
+          errno = EINVAL;
+          return -1;
+        }
+        args.low_latency.rt_priority = priority;
+      } break;
+      case 'n': {
+        char* end = 0;
+        errno = 0;
+        long nice = strtol(optarg, &end, 10);
+        if(errno || *end || !*optarg || nice < -20 || nice > 19){
+          errno = EINVAL;
+          return -1;
+        }
+        args.low_latency.set_nice = true;
+        args.low_latency.nice = nice;
+      } break;
+      case 'c': {
+        if(low_latency_parse_cpus(optarg) == -1)
+          return -1;
+        args.low_latency.set_cpus = true;
+      } break;
+      case 'd': {
+        char* end = 0;
+        errno = 0;
+        unsigned long delay = strtoul(optarg, &end, 10);
+        if(errno || *end || !*optarg || delay > 1000){
+          errno = EINVAL;
+          return -1;
+        }
+        args.resize_delay = delay;
+      } break;
       case 'u': {
         args.main_user.option = true;
         if(parse_user(&args.main_user, optarg) == -1)
@@ -621,6 +1008,28 @@ int parseopts(int* pargc, char*** pargv){
     return -1;
   }
 
+  struct low_latency_options* ll = &args.low_latency;
+  if(!ll->enabled && (ll->rt_priority || ll->set_nice || ll->set_cpus)){
+    errno = EINVAL;
+    return -1;
+  }
+
+  // There is no keyboard when replaying a recording
+  if(args.replay_fast && !args.replay){
+    errno = EINVAL;
+    return -1;
+  }
+  if(args.replay && (args.standby_keyboard || args.shm_ring_size || 0 <= args.print_fd)){
+    errno = EINVAL;
+    return -1;
+  }
+
+  // In retain pid mode, the program is our parent, and with -p, we don't start it
+  if(args.respawn && (args.retain_pid || 0 <= args.print_fd)){
+    errno = EINVAL;
+    return -1;
+  }
+
   if(nargs){
     argv[opt_argc] = *argv;
     argc -= opt_argc;
@@ -708,6 +1117,27 @@ nope:
 
 int childexitnotifier = -1;
 int childs[2] = {-1,-1};
+int child_pidfds[2] = {-1,-1};
+const char* const child_names[2] = {"program", "keyboard"};
+
+int ckm_pidfd_open(pid_t pid){
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+// Check if children can be watched using pidfds, which needs linux 5.3 or newer
+bool pidfd_supported(void){
+  int fd = ckm_pidfd_open(getpid());
+  if(fd == -1)
+    return false;
+  close(fd);
+  return true;
+}
 
 void childexit(int x){
   (void)x;
@@ -744,6 +1174,109 @@ static int do_print_args(int pane, void* ptr, size_t count, const char* env[coun
 
 int ptscheckfd[2];
 
+// Removes the bind mounted pts at args.ttyname, if it's still the expected one
+int remove_tty_link(const dev_t d[2]){
+  struct stat st;
+  if(stat(args.ttyname, &st) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "stat failed");
+    return -1;
+  }
+  if(!(st.st_mode & S_IFCHR) || st.st_dev != d[0] || st.st_rdev != d[1]){
+    TYM_U_LOG(TYM_LOG_ERROR, "File \"%s\" isn't the expected pts. Not removing it.", args.ttyname);
+    return -1;
+  }
+  if(umount2(args.ttyname, UMOUNT_NOFOLLOW|MNT_DETACH|MNT_FORCE) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "umount failed");
+    return -1;
+  }
+  if(unlink(args.ttyname) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "unlink failed");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * With --inline-tty-cleanup, there is no cleanup subroutine process. The multiplexer
+ * removes the pts itself when it exits, including when it gets a SIGTERM, SIGINT or
+ * SIGHUP. Those are turned into events for the main loop. If the multiplexer is
+ * killed or crashes, the stale pts stays until the next time a multiplexer with the
+ * same ttyname starts and cleans it up. When the multiplexer drops its privileges,
+ * it only keeps the capabilities needed for removing the pts, see keep_tty_link_caps.
+ */
+static bool tty_link_created = false;
+static pid_t tty_link_owner;
+static dev_t tty_link_dev[2];
+static int termination_notifier = -1;
+
+// Unmounting the pts needs CAP_SYS_ADMIN, removing the file it was mounted on from /dev needs CAP_DAC_OVERRIDE
+#define TTY_LINK_CAPS (1u << CAP_SYS_ADMIN | 1u << CAP_DAC_OVERRIDE)
+
+static int set_caps(uint32_t permitted, uint32_t effective){
+  struct __user_cap_header_struct header = {
+    .version = _LINUX_CAPABILITY_VERSION_3
+  };
+  struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3] = {{
+    .permitted = permitted,
+    .effective = effective
+  }};
+  return syscall(SYS_capset, &header, data);
+}
+
+/**
+ * Called before the multiplexer changes its user. Only the capabilities in TTY_LINK_CAPS
+ * are kept, and they are only made effective for removing the pts. Programs started
+ * afterwards don't get them, since they are lost when a non-root user calls execve.
+ */
+static int keep_tty_link_caps(void){
+  return prctl(PR_SET_KEEPCAPS, 1, 0, 0, 0);
+}
+
+// Called after the multiplexer changed its user
+static int drop_to_tty_link_caps(void){
+  if(prctl(PR_SET_KEEPCAPS, 0, 0, 0, 0) == -1)
+    return -1;
+  return set_caps(TTY_LINK_CAPS, 0);
+}
+
+static void remove_tty_link_atexit(void){
+  if(!tty_link_created || getpid() != tty_link_owner)
+    return;
+  tty_link_created = false;
+  // Fails if we didn't drop our privileges, in which case we have them all anyway
+  if(getuid() != 0)
+    set_caps(TTY_LINK_CAPS, TTY_LINK_CAPS);
+  remove_tty_link(tty_link_dev);
+}
+
+static void termination_signal(int signo){
+  (void)signo;
+  int err = errno;
+  while(write(termination_notifier, (uint64_t[]){1}, sizeof(uint64_t)) == -1 && errno == EINTR);
+  errno = err;
+}
+
+int watch_termination_signals(void){
+  termination_notifier = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(termination_notifier == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "eventfd failed");
+    return -1;
+  }
+  signal(SIGTERM, termination_signal);
+  signal(SIGINT, termination_signal);
+  signal(SIGHUP, termination_signal);
+  return termination_notifier;
+}
+
+// For processes forked from the multiplexer which are going to exec something else
+void forget_termination_signals(void){
+  if(termination_notifier == -1)
+    return;
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+}
+
 int start_tty_cleanup_subroutine(){
   if(pipe(ptscheckfd) == -1){
     TYM_U_PERROR(TYM_LOG_ERROR, "pipe failed");
@@ -765,6 +1298,8 @@ int start_tty_cleanup_subroutine(){
     return 0;
   }
   close(ptscheckfd[1]);
+  // Don't keep the trace file open, the report is written by the multiplexer
+  startup_trace_abandon();
   signal(SIGTERM, SIG_IGN);
   signal(SIGHUP, SIG_IGN);
   signal(SIGINT, SIG_IGN);
@@ -815,41 +1350,620 @@ int start_tty_cleanup_subroutine(){
     }
     close(fd);
   }
-  struct stat st;
-  if(stat(args.ttyname, &st) == -1){
-    TYM_U_PERROR(TYM_LOG_ERROR, "stat failed");
-    exit(1);
+  exit(remove_tty_link(d) == -1 ? 1 : 0);
+}
+
+static struct command_reader keyboard_reader;
+
+static pid_t standby_pid = -1;
+static int standby_pidfd = -1;
+static int standby_cfd = -1;
+unsigned long keyboard_takeovers = 0;
+
+static int set_builder_env(void* ptr, const char* name, const char* value){
+  return env_builder_set(ptr, name, value);
+}
+
+static int add_default_env(int pane, void* ptr, size_t count, const char* env[count][2]){
+  (void)pane;
+  for(size_t i=0; i<count; i++)
+    if(env_builder_set(ptr, env[i][0], env[i][1]) == -1)
+      return -1;
+  return 0;
+}
+
+// Whether libttymultiplex is frozen for forking
+static bool tym_frozen = false;
+
+// Set once spawn_pane failed because the kernel lacks something it needs, so we don't try again
+static bool spawn_pane_unsupported = false;
+
+/**
+ * Starts a program in a pane. If pidfds are supported, it's started with spawn_pane,
+ * which doesn't need to copy the address space of the multiplexer or go through the
+ * handshake of execpane. Otherwise, or if that isn't possible, execpane is used.
+ */
+pid_t start_pane(int* pane, char* argv[], size_t fd_count, const int fds[fd_count], bool use_spawn, int* pidfd){
+  extern char** environ;
+  uint64_t start = ckm_now();
+  *pidfd = -1;
+  if(use_spawn && !spawn_pane_unsupported){
+    struct env_builder env;
+    if(env_builder_init(&env, environ) == -1)
+      return -1;
+    if( tym_pane_get_default_env_vars(*pane, &env, add_default_env) == -1
+     || set_pane_env(*pane, getpid(), set_builder_env, &env) == -1
+    ){
+      env_builder_destroy(&env);
+      return -1;
+    }
+    struct user_group ug = *pane == top_pane ? args.program_user : args.keyboard_user;
+    struct spawn_options options = {
+      .argv = argv,
+      .envp = env.vars,
+      .tty = tym_pane_get_slavefd(*pane),
+      .fd_count = fd_count,
+      .fds = fds,
+      .change_user = !ug.ignore,
+      .change_user_fatal = getuid() == 0,
+      .uid = ug.user,
+      .gid = ug.group,
+      .group_count = ug.supplementary_group_count,
+      .groups = ug.supplementary_group_list,
+      .prepare = low_latency_leave,
+    };
+    pid_t pid = spawn_pane(&options, pidfd);
+    int error = errno;
+    env_builder_destroy(&env);
+    if(pid != -1){
+      startup_trace_point("spawn_pane", -1);
+      TYM_U_LOG(TYM_LOG_DEBUG, "started %s using spawn_pane in %.3fms\n", argv[0], (ckm_now() - start) / 1e6);
+      return pid;
+    }
+    errno = error;
+    // Fall back to execpane if clone or close_range don't support the flags we need
+    if(errno != EINVAL && errno != ENOSYS){
+      TYM_U_PERROR(TYM_LOG_ERROR, "failed to start %s", argv[0]);
+      return -1;
+    }
+    spawn_pane_unsupported = true;
+  }
+  pid_t pid = execpane(pane, 1, (execpane_setup_t[]){execpane_init}, argv, fd_count, fds, false);
+  if(pid != -1)
+    startup_trace_point("execpane", -1);
+  if(pid != -1)
+    TYM_U_LOG(TYM_LOG_DEBUG, "started %s using execpane in %.3fms\n", argv[0], (ckm_now() - start) / 1e6);
+  return pid;
+}
+
+/**
+ * In respawn mode, the program in the top pane is started again when it exits,
+ * while the keyboard, the panes and their contents stay as they are. If it keeps
+ * exiting right after being started, we give up and exit too, so whatever started
+ * us can deal with it.
+ */
+#define RESPAWN_MIN_RUNTIME_MS 1000
+#define RESPAWN_MAX_FAST_EXITS 5
+
+static char** program_argv;
+static bool program_use_pidfd;
+static uint64_t program_start_time;
+static unsigned program_fast_exits = 0;
+unsigned long program_respawns = 0;
+
+/**
+ * start_pane for when libttymultiplex may be running. If the pane is going to be
+ * started using execpane, which forks, the library is frozen around it, like at startup.
+ * spawn_pane doesn't need that.
+ */
+pid_t start_pane_while_running(int* pane, char* argv[], size_t fd_count, const int fds[fd_count], bool use_spawn, int* pidfd){
+  bool freeze = !tym_frozen && (!use_spawn || spawn_pane_unsupported);
+  if(freeze){
+    if(tym_freeze() == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "tym_freeze failed");
+      return -1;
+    }
+    tym_frozen = true;
+  }
+  pid_t pid = start_pane(pane, argv, fd_count, fds, use_spawn, pidfd);
+  int error = errno;
+  if(freeze){
+    if(tym_init()){
+      TYM_U_PERROR(TYM_LOG_FATAL, "tym_init failed");
+      event_loop_stop();
+    }else{
+      tym_frozen = false;
+    }
   }
-  if(!(st.st_mode & S_IFCHR) || st.st_dev != d[0] || st.st_rdev != d[1]){
-    TYM_U_LOG(TYM_LOG_ERROR, "File \"%s\" isn't the expected pts. Not removing it.", args.ttyname);
-    exit(1);
+  errno = error;
+  return pid;
+}
+
+int respawn_program(void){
+  uint64_t now = ckm_now();
+  if(now - program_start_time < RESPAWN_MIN_RUNTIME_MS * 1000000ull){
+    if(++program_fast_exits >= RESPAWN_MAX_FAST_EXITS){
+      TYM_U_LOG(TYM_LOG_ERROR, "The program exited %u times right after it was started, not starting it again\n", program_fast_exits);
+      errno = EAGAIN;
+      return -1;
+    }
+  }else{
+    program_fast_exits = 0;
   }
-  if(umount2(args.ttyname, UMOUNT_NOFOLLOW|MNT_DETACH|MNT_FORCE) == -1){
-    TYM_U_PERROR(TYM_LOG_ERROR, "umount failed");
-    exit(1);
+  program_start_time = now;
+  if((childs[0]=start_pane_while_running(&top_pane, program_argv, 0, 0, program_use_pidfd, &child_pidfds[0])) == -1)
+    return -1;
+  if(program_use_pidfd && child_pidfds[0] == -1){
+    child_pidfds[0] = ckm_pidfd_open(childs[0]);
+    if(child_pidfds[0] == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "pidfd_open failed");
+      return -1;
+    }
   }
-  if(unlink(args.ttyname) == -1){
-    TYM_U_PERROR(TYM_LOG_ERROR, "unlink failed");
-    exit(1);
+  program_respawns++;
+  TYM_U_LOG(TYM_LOG_INFO, "Started the program again (pid %ld) in %.3fms\n", (long)childs[0], (ckm_now() - now) / 1e6);
+  return 0;
+}
+
+// Only the program is respawned, if the keyboard is gone too, we exit
+static bool should_respawn_program(void){
+  return args.respawn && childs[0] == -1 && childs[1] != -1;
+}
+
+int on_child_notification(struct event_source* source, uint32_t events){
+  (void)events;
+  while(true){
+    unsigned char c = 0;
+    int r = read(source->fd, &c, 1);
+    if(r == -1 && errno == EINTR)
+      continue;
+    if(r == -1)
+      break;
+    if(r == 0){
+      event_loop_stop();
+      break;
+    }
+    if(c == 0){
+      // The SIGCHLD handler doesn't tell us the wait status
+      command_record_child_exit(childs[0] == -1 ? 0 : 1, false, 0);
+      if(should_respawn_program() && respawn_program() != -1)
+        continue;
+      event_loop_stop();
+      break;
+    }
+  }
+  return 0;
+}
+
+int promote_standby_keyboard(struct event_source* exit_source);
+
+int on_child_exit(struct event_source* source, uint32_t events){
+  (void)events;
+  int i = *(int*)source->ptr;
+  int status = 0;
+  while(waitpid(childs[i], &status, 0) == -1 && errno == EINTR);
+  command_record_child_exit(i, true, status);
+  TYM_U_LOG(TYM_LOG_INFO, "The %s (pid %ld) exited\n", child_names[i], (long)childs[i]);
+  event_loop_remove(source);
+  close(child_pidfds[i]);
+  child_pidfds[i] = -1;
+  childs[i] = -1;
+  if(i == 1 && standby_pid != -1 && promote_standby_keyboard(source) != -1)
+    return 0;
+  if(i == 0 && should_respawn_program()){
+    if(respawn_program() != -1){
+      source->fd = child_pidfds[0];
+      if(event_loop_add(source) != -1)
+        return 0;
+    }
+  }
+  event_loop_stop();
+  return 0;
+}
+
+int on_termination_signal(struct event_source* source, uint32_t events){
+  (void)events;
+  uint64_t count;
+  if(read(source->fd, &count, sizeof(count)) == sizeof(count))
+    TYM_U_LOG(TYM_LOG_INFO, "Got a termination signal, exiting\n");
+  event_loop_stop();
+  return 0;
+}
+
+int on_keyboard_input(struct event_source* source, uint32_t events){
+  if(events & EPOLLIN)
+    command_reader_read(&keyboard_reader, source->fd, parse_command, 0);
+  return 0;
+}
+
+int on_keyboard_ring(struct event_source* source, uint32_t events){
+  (void)events;
+  if(shm_ring_read(&keyboard_ring, &keyboard_reader, parse_command, 0) == -1){
+    TYM_U_LOG(TYM_LOG_ERROR, "Disabling keyboard ring\n");
+    event_loop_remove(source);
+    shm_ring_destroy(&keyboard_ring);
+  }
+  return 0;
+}
+
+static struct event_source keyboard_input_source = {
+  .name = "keyboard input",
+  .fd = -1,
+  .events = EPOLLIN,
+  .priority = EVENT_PRIORITY_KEYBOARD,
+  .handler = on_keyboard_input,
+};
+
+static struct event_source keyboard_ring_source = {
+  .name = "keyboard ring",
+  .fd = -1,
+  .events = EPOLLIN,
+  .priority = EVENT_PRIORITY_KEYBOARD,
+  .handler = on_keyboard_ring,
+};
+
+int on_standby_exit(struct event_source* source, uint32_t events);
+
+static struct event_source standby_exit_source = {
+  .name = "standby keyboard pidfd",
+  .fd = -1,
+  .events = EPOLLIN | EPOLLHUP,
+  .priority = EVENT_PRIORITY_CHILD,
+  .handler = on_standby_exit,
+};
+
+void stop_standby_keyboard(void){
+  if(standby_pid != -1){
+    kill(standby_pid, SIGKILL);
+    while(waitpid(standby_pid, 0, 0) == -1 && errno == EINTR);
+    standby_pid = -1;
+  }
+  if(standby_pidfd != -1){
+    close(standby_pidfd);
+    standby_pidfd = -1;
+  }
+  if(standby_cfd != -1){
+    close(standby_cfd);
+    standby_cfd = -1;
+  }
+  if(standby_pane != -1){
+    tym_pane_destroy(standby_pane);
+    standby_pane = -1;
+  }
+}
+
+/**
+ * With -z, a second keyboard is started in advance, in a pane without any height.
+ * It can initialise itself, but its commands are only read once it replaces the
+ * keyboard. When the keyboard exits, the standby keyboard takes over its place, and
+ * a new standby keyboard is started. It isn't offered the shared memory ring.
+ * This needs pidfds, the SIGCHLD fallback only knows about the program & keyboard.
+ */
+int start_standby_keyboard(void){
+  int cfd[2];
+  standby_pane = tym_pane_create(&standby_pane_coordinates);
+  if(standby_pane == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "tym_pane_create failed");
+    return -1;
+  }
+  tym_pane_set_flag(standby_pane, TYM_PF_DISALLOW_FOCUS, true);
+  if(pipe(cfd) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "pipe failed");
+    goto error;
+  }
+  fcntl(cfd[0], F_SETFL, O_NONBLOCK);
+  fcntl(cfd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(cfd[1], F_SETFD, FD_CLOEXEC);
+  standby_cfd = cfd[0];
+  standby_pid = start_pane_while_running(&standby_pane, args.keyboard, 1, (int[]){cfd[1]}, true, &standby_pidfd);
+  close(cfd[1]);
+  if(standby_pid == -1)
+    goto error;
+  if(standby_pidfd == -1){
+    standby_pidfd = ckm_pidfd_open(standby_pid);
+    if(standby_pidfd == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "pidfd_open failed");
+      goto error;
+    }
+  }
+  standby_exit_source.fd = standby_pidfd;
+  return 0;
+error:
+  stop_standby_keyboard();
+  return -1;
+}
+
+int on_standby_exit(struct event_source* source, uint32_t events){
+  (void)events;
+  TYM_U_LOG(TYM_LOG_WARN, "The standby keyboard (pid %ld) exited, continuing without one\n", (long)standby_pid);
+  event_loop_remove(source);
+  stop_standby_keyboard();
+  return 0;
+}
+
+int promote_standby_keyboard(struct event_source* exit_source){
+  uint64_t start = ckm_now();
+  event_loop_remove(&standby_exit_source);
+  event_loop_remove(&keyboard_input_source);
+  close(keyboard_input_source.fd);
+  if(keyboard_ring.ring){
+    event_loop_remove(&keyboard_ring_source);
+    shm_ring_destroy(&keyboard_ring);
+  }
+  command_reader_log_stats(&keyboard_reader, "keyboard");
+  command_reader_destroy(&keyboard_reader);
+  keyboard_send_time = 0;
+
+  if(tym_pane_destroy(bottom_pane) == -1)
+    TYM_U_PERROR(TYM_LOG_WARN, "tym_pane_destroy failed");
+  bottom_pane = standby_pane;
+  standby_pane = -1;
+  if(tym_pane_resize(bottom_pane, &bottom_pane_coordinates) == -1)
+    TYM_U_PERROR(TYM_LOG_ERROR, "tym_pane_resize failed");
+
+  childs[1] = standby_pid;
+  child_pidfds[1] = standby_pidfd;
+  keyboard_input_source.fd = standby_cfd;
+  standby_pid = -1;
+  standby_pidfd = -1;
+  standby_cfd = -1;
+
+  if(command_reader_init(&keyboard_reader, args.max_frame_size) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "command_reader_init failed");
+    return -1;
+  }
+  if(args.low_latency.enabled && command_reader_reserve(&keyboard_reader) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "command_reader_reserve failed");
+    return -1;
+  }
+  exit_source->fd = child_pidfds[1];
+  if(event_loop_add(exit_source) == -1)
+    return -1;
+  if(event_loop_add(&keyboard_input_source) == -1)
+    return -1;
+  keyboard_takeovers++;
+  TYM_U_LOG(TYM_LOG_INFO, "The standby keyboard (pid %ld) took over in %.3fms\n", (long)childs[1], (ckm_now() - start) / 1e6);
+
+  if(start_standby_keyboard() == -1 || event_loop_add(&standby_exit_source) == -1){
+    TYM_U_LOG(TYM_LOG_WARN, "Failed to start a new standby keyboard, continuing without one\n");
+    stop_standby_keyboard();
+  }
+  return 0;
+}
+
+void log_stats(void){
+  command_reader_log_stats(&keyboard_reader, "keyboard");
+  if(args.standby_keyboard)
+    TYM_U_LOG(TYM_LOG_INFO, "keyboard: replaced by the standby keyboard %lu times\n", keyboard_takeovers);
+  if(args.respawn)
+    TYM_U_LOG(TYM_LOG_INFO, "program: started again %lu times\n", program_respawns);
+  TYM_U_LOG(TYM_LOG_INFO, "keyboard height: %lu changes requested, %lu applied\n", resizes_requested, resizes_applied);
+  latency_histogram_log(&resize_latency, "keyboard height change latency");
+  TYM_U_LOG(TYM_LOG_INFO, "keyboard commands: at most %.3fms after wakeup, %lu took longer than %dms\n",
+    keyboard_max_delay / 1e6, keyboard_deadline_misses, KEYBOARD_DEADLINE_MS);
+  latency_histogram_log(&keyboard_latency, "keyboard command latency");
+  command_stats_log();
+}
+
+static void reset_stats(void){
+  event_loop_reset_wakeups();
+  command_stats_reset();
+  latency_histogram_reset(&keyboard_latency);
+  latency_histogram_reset(&resize_latency);
+  keyboard_max_delay = 0;
+  keyboard_deadline_misses = 0;
+  resizes_requested = 0;
+  resizes_applied = 0;
+  program_respawns = 0;
+  keyboard_takeovers = 0;
+  keyboard_reader.wakeups = 0;
+  keyboard_reader.frames = 0;
+  keyboard_reader.max_frames_per_wakeup = 0;
+  keyboard_reader.dropped_frames = 0;
+}
+
+/**
+ * The commands of the stats socket:
+ *  - stats, or an empty line: All counters, in the prometheus text format
+ *  - reset: Sets all counters back to 0
+ *  - geometry: The panes and the height of the keyboard
+ */
+int stats_command(FILE* out, const char* command){
+  if(!*command || !strcmp(command, "stats")){
+    fprintf(out, "ckm_event_loop_wakeups_total %llu\n", (unsigned long long)event_loop_wakeups());
+    fprintf(out, "ckm_keyboard_wakeups_total %zu\n", keyboard_reader.wakeups);
+    fprintf(out, "ckm_keyboard_frames_total %zu\n", keyboard_reader.frames);
+    fprintf(out, "ckm_keyboard_dropped_frames_total %zu\n", keyboard_reader.dropped_frames);
+    fprintf(out, "ckm_keyboard_max_frames_per_wakeup %zu\n", keyboard_reader.max_frames_per_wakeup);
+    fprintf(out, "ckm_keyboard_deadline_misses_total %lu\n", keyboard_deadline_misses);
+    fprintf(out, "ckm_resizes_requested_total %lu\n", resizes_requested);
+    fprintf(out, "ckm_resizes_applied_total %lu\n", resizes_applied);
+    fprintf(out, "ckm_child_restarts_total{child=\"program\"} %lu\n", program_respawns);
+    fprintf(out, "ckm_child_restarts_total{child=\"keyboard\"} %lu\n", keyboard_takeovers);
+    command_stats_write(out);
+    latency_histogram_write(out, &keyboard_latency, "ckm_keyboard_latency_seconds", "");
+    latency_histogram_write(out, &resize_latency, "ckm_resize_latency_seconds", "");
+    return 0;
+  }
+  if(!strcmp(command, "reset")){
+    reset_stats();
+    fprintf(out, "ok\n");
+    return 0;
+  }
+  if(!strcmp(command, "geometry")){
+    fprintf(out, "top_pane %d\n", top_pane);
+    fprintf(out, "bottom_pane %d\n", bottom_pane);
+    fprintf(out, "standby_pane %d\n", standby_pane);
+    fprintf(out, "keyboard_height %ld\n", keyboard_height);
+    fprintf(out, "keyboard_height_pending %ld\n", keyboard_size_pending ? (long)pending_keyboard_size.character : -1);
+    return 0;
+  }
+  return -1;
+}
+
+// SIGUSR1 logs the statistics, like when exiting
+static int stats_notifier = -1;
+
+static void stats_signal(int signo){
+  (void)signo;
+  int err = errno;
+  while(write(stats_notifier, (uint64_t[]){1}, sizeof(uint64_t)) == -1 && errno == EINTR);
+  errno = err;
+}
+
+int on_stats_signal(struct event_source* source, uint32_t events){
+  (void)events;
+  uint64_t count;
+  if(read(source->fd, &count, sizeof(count)) == sizeof(count))
+    log_stats();
+  return 0;
+}
+
+/**
+ * With -i, the frames of a recording are handled as if they came from the keyboard,
+ * which isn't started. Either at the same pace as they were recorded, or with -x,
+ * as fast as possible, in batches, so other events are still handled in between.
+ * The other records are only informational. If the program exited during the
+ * recording, we wait for it to exit again once the recording ends. Otherwise, we
+ * exit once the program read everything it was sent, but wait at most
+ * REPLAY_DRAIN_MS for that.
+ */
+#define REPLAY_BATCH 64
+#define REPLAY_DRAIN_MS 1000
+#define REPLAY_DRAIN_POLL_MS 10
+
+static struct record_reader replay;
+static struct record replay_record;
+static bool replay_pending = false;
+static bool replay_program_exited = false;
+static uint64_t replay_drain_deadline = 0;
+static uint64_t replay_start;
+unsigned long replayed_frames = 0;
+
+static int arm_replay_timer(int fd){
+  struct itimerspec timer = {0};
+  uint64_t at = replay_start + replay_record.time;
+  int flags = TFD_TIMER_ABSTIME;
+  if(args.replay_fast){
+    timer.it_value.tv_nsec = 1;
+    flags = 0;
+  }else{
+    timer.it_value.tv_sec = at / 1000000000;
+    timer.it_value.tv_nsec = at % 1000000000;
+  }
+  if(timerfd_settime(fd, flags, &timer, 0) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "timerfd_settime failed");
+    return -1;
   }
-  exit(0);
+  return 0;
+}
+
+static int arm_replay_drain_timer(int fd){
+  struct itimerspec timer = {
+    .it_value.tv_nsec = REPLAY_DRAIN_POLL_MS * 1000000l,
+  };
+  if(timerfd_settime(fd, 0, &timer, 0) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "timerfd_settime failed");
+    return -1;
+  }
+  return 0;
+}
+
+// Whether the program hasn't read everything we typed yet
+static bool replay_input_pending(void){
+  int pending = 0;
+  int fd = tym_pane_get_slavefd(top_pane);
+  if(fd == -1 || ioctl(fd, FIONREAD, &pending) == -1)
+    return false;
+  return pending > 0;
+}
+
+static int replay_next(void){
+  int ret = record_reader_next(&replay, &replay_record);
+  replay_pending = ret == 1;
+  return ret;
+}
+
+int on_replay_timer(struct event_source* source, uint32_t events){
+  (void)events;
+  uint64_t count;
+  while(read(source->fd, &count, sizeof(count)) == -1 && errno == EINTR);
+  for(unsigned n=0; replay_pending; n++){
+    if(args.replay_fast ? n >= REPLAY_BATCH : replay_start + replay_record.time > ckm_now())
+      break;
+    // The timestamps are from when the recording was made
+    if(replay_record.type == RECORD_FRAME && !(replay_record.size && replay_record.data[0] == CKM_TIMESTAMP)){
+      parse_command(0, replay_record.size, replay_record.data);
+      replayed_frames++;
+    }
+    if(replay_record.type == RECORD_CHILD_EXIT && replay_record.child == 0)
+      replay_program_exited = true;
+    if(replay_next() == -1){
+      event_loop_stop();
+      return 0;
+    }
+  }
+  if(!replay_pending){
+    uint64_t now = ckm_now();
+    if(!replay_drain_deadline){
+      TYM_U_LOG(TYM_LOG_INFO, "Replayed %lu frames in %.3fms\n", replayed_frames, (now - replay_start) / 1e6);
+      if(replay_program_exited)
+        return 0;
+      replay_drain_deadline = now + REPLAY_DRAIN_MS * 1000000ull;
+    }
+    if(replay_input_pending()){
+      if(now < replay_drain_deadline && arm_replay_drain_timer(source->fd) != -1)
+        return 0;
+      TYM_U_LOG(TYM_LOG_WARN, "The program didn't read all of its input within %dms\n", REPLAY_DRAIN_MS);
+    }
+    event_loop_stop();
+    return 0;
+  }
+  if(arm_replay_timer(source->fd) == -1)
+    event_loop_stop();
+  return 0;
 }
 
 int main(int argc, char* argv[]){
 
-  is_session_leader = getpid() == getsid(0);
+  startup_trace_point("main", -1);
 
   if(parseopts(&argc, &argv) == -1){
     TYM_U_PERROR(TYM_LOG_FATAL, "parseopts failed");
     usage(false);
     return 1;
   }
+  startup_trace_point("parseopts", -1);
 
   if(args.help){
     usage(true);
     return 0;
   }
 
+  if(args.replay){
+    if(record_reader_open(&replay, args.replay) == -1){
+      TYM_U_PERROR(TYM_LOG_FATAL, "failed to open the recording %s", args.replay);
+      return 1;
+    }
+    if(replay_next() == -1)
+      return 1;
+    // The panes have a different size on a different terminal, which makes the replay hard to compare
+    struct winsize size;
+    if( replay.rows && replay.columns && ioctl(STDIN_FILENO, TIOCGWINSZ, &size) != -1
+     && size.ws_row && size.ws_col && (size.ws_row != replay.rows || size.ws_col != replay.columns)
+    ){
+      TYM_U_LOG(TYM_LOG_WARN, "The recording was made on a %ux%u terminal, but this one is %ux%u\n",
+        replay.columns, replay.rows, (unsigned)size.ws_col, (unsigned)size.ws_row);
+    }
+  }
+
+  if(args.startup_trace){
+    if(startup_trace_open(args.startup_trace) == -1){
+      TYM_U_PERROR(TYM_LOG_FATAL, "startup_trace_open failed");
+      return 1;
+    }
+  }
+
   if(args.print_fd >= 0){
     if(fcntl(args.print_fd, F_SETFD, FD_CLOEXEC) == -1){
       TYM_U_PERROR(TYM_LOG_FATAL, "fcntl(args.print_fd, F_SETFD, FD_CLOEXEC) failed");
@@ -857,11 +1971,12 @@ int main(int argc, char* argv[]){
     }
   }
 
-  if(args.ttyname){
+  if(args.ttyname && !args.inline_tty_cleanup){
     if(start_tty_cleanup_subroutine() == -1){
       TYM_U_PERROR(TYM_LOG_FATAL, "start_tty_cleanup_subroutine failed");
       return 1;
     }
+    startup_trace_point("start_tty_cleanup_subroutine", -1);
   }
 
   atexit(cleanup);
@@ -871,6 +1986,7 @@ int main(int argc, char* argv[]){
     TYM_U_PERROR(TYM_LOG_FATAL, "tym_init failed");
     return 1;
   }
+  startup_trace_point("tym_init", -1);
 
   struct lck_super_size size = {
     .character = 12
@@ -888,20 +2004,27 @@ int main(int argc, char* argv[]){
   }
   tym_pane_set_flag(bottom_pane, TYM_PF_DISALLOW_FOCUS, true);
   tym_pane_set_flag(top_pane, TYM_PF_FOCUS, true);
-
-  int sfd[2];
-  if(pipe(sfd) == -1){
-    TYM_U_PERROR(TYM_LOG_FATAL, "pipe failed");
-    return 1;
+  startup_trace_point("tym_pane_create", -1);
+
+  // Without pidfds, fall back to a SIGCHLD handler, which notifies the main loop using a pipe
+  bool use_pidfd = pidfd_supported();
+  int sfd[2] = {-1,-1};
+  if(!use_pidfd){
+    if(pipe(sfd) == -1){
+      TYM_U_PERROR(TYM_LOG_FATAL, "pipe failed");
+      return 1;
+    }
+    childexitnotifier = sfd[1];
+    signal(SIGCHLD, childexit);
   }
-  childexitnotifier = sfd[1];
-  signal(SIGCHLD, childexit);
 
   // Freeze libttymultiplex because of upcoming forks
   if(tym_freeze() == -1){
     TYM_U_PERROR(TYM_LOG_FATAL, "tym_freeze failed");
     return 1;
   }
+  tym_frozen = true;
+  startup_trace_point("tym_freeze", -1);
 
   if(args.ttyname){
     int ptsfd = tym_pane_get_slavefd(top_pane);
@@ -973,7 +2096,15 @@ int main(int argc, char* argv[]){
       goto sub_error_after_open;
     }
     close(newpts);
-    {
+    if(args.inline_tty_cleanup){
+      if(watch_termination_signals() == -1)
+        goto sub_error_after_mount;
+      tty_link_dev[0] = st.st_dev;
+      tty_link_dev[1] = st.st_rdev;
+      tty_link_owner = getpid();
+      tty_link_created = true;
+      atexit(remove_tty_link_atexit);
+    }else{
       while( true ){
         if(write(ptscheckfd[1], (dev_t[]){st.st_dev, st.st_rdev}, sizeof(dev_t[2])) < 0){
           if(errno == EINTR)
@@ -984,6 +2115,7 @@ int main(int argc, char* argv[]){
         break;
       }
     }
+    startup_trace_point("bind_mount", -1);
     if(0){
     sub_error_after_open:
       close(newpts);
@@ -1002,12 +2134,19 @@ int main(int argc, char* argv[]){
   // Execute programs
   if(args.print_fd < 0){
     if(args.retain_pid){
-      if((childs[0]=execpane(&top_pane, 4, (execpane_setup_t[]){0,execpane_takeover_tty,execpane_init,execpane_takeover_tty2}, argv+1, -1, true)) == -1)
+      if((childs[0]=execpane(&top_pane, 5, (execpane_setup_t[]){execpane_ignore_hup,execpane_takeover_tty,execpane_init,execpane_takeover_tty2,execpane_restore_hup}, argv+1, 0, 0, true)) == -1)
         return 1;
+      // We continue in the forked process, it's the one which has to remove the pts now
+      if(tty_link_created)
+        tty_link_owner = getpid();
     }else{
-      if((childs[0]=execpane(&top_pane, 1, (execpane_setup_t[]){execpane_init}, argv+1, -1, false)) == -1)
+      program_argv = argv + 1;
+      program_use_pidfd = use_pidfd;
+      program_start_time = ckm_now();
+      if((childs[0]=start_pane(&top_pane, program_argv, 0, 0, use_pidfd, &child_pidfds[0])) == -1)
         return 1;
     }
+    startup_trace_point("program_started", -1);
   }
   int cfd[2];
   if(pipe(cfd) == -1){
@@ -1015,12 +2154,81 @@ int main(int argc, char* argv[]){
     return 1;
   }
   fcntl(cfd[0], F_SETFL, O_NONBLOCK);
-  if((childs[1]=execpane(&bottom_pane, 1, (execpane_setup_t[]){execpane_init}, args.keyboard, cfd[1], false)) == -1)
-    return -1;
+  if(args.shm_ring_size){
+    if(shm_ring_create(&keyboard_ring, args.shm_ring_size) == -1){
+      TYM_U_PERROR(TYM_LOG_FATAL, "shm_ring_create failed");
+      return 1;
+    }
+  }
+  int keyboard_fds[] = {cfd[1], keyboard_ring.memfd, keyboard_ring.doorbell};
+  if(!args.replay){
+    if((childs[1]=start_pane(&bottom_pane, args.keyboard, keyboard_ring.ring ? 3 : 1, keyboard_fds, use_pidfd, &child_pidfds[1])) == -1)
+      return -1;
+    startup_trace_point("keyboard_started", -1);
+  }
   close(cfd[1]);
+  if(args.standby_keyboard){
+    if(!use_pidfd){
+      TYM_U_LOG(TYM_LOG_WARN, "A standby keyboard needs pidfds, which aren't supported. Not starting one.\n");
+    }else if(start_standby_keyboard() == -1){
+      TYM_U_LOG(TYM_LOG_WARN, "Failed to start the standby keyboard, continuing without one\n");
+    }else{
+      // The pipe of a crashed keyboard may hang up before its pidfd tells us it exited,
+      // which is where the standby keyboard takes over, or we exit if there is none.
+      keyboard_input_source.events |= EPOLLHUP;
+      startup_trace_point("standby_keyboard_started", -1);
+    }
+  }
+  for(int i=0; use_pidfd && i<2; i++){
+    if(childs[i] == -1 || child_pidfds[i] != -1)
+      continue;
+    // In retain pid mode, the program is our parent. This works for it too, we just can't wait for it.
+    child_pidfds[i] = ckm_pidfd_open(childs[i]);
+    if(child_pidfds[i] == -1){
+      TYM_U_PERROR(TYM_LOG_FATAL, "pidfd_open failed");
+      return 1;
+    }
+  }
+  if(keyboard_ring.ring){
+    close(keyboard_ring.memfd);
+    keyboard_ring.memfd = -1;
+  }
+
+  if(args.stats_socket_dir){
+    // Named after the pts created using -l, or our pid
+    char path[PATH_MAX];
+    if(args.ttyname)
+      snprintf(path, sizeof(path), "%s/%s.sock", args.stats_socket_dir, args.ttyname + strlen("/dev/"));
+    else
+      snprintf(path, sizeof(path), "%s/%ld.sock", args.stats_socket_dir, (long)getpid());
+    // Clients in the group of the user this program runs as may connect
+    uid_t uid = args.main_user.ignore ? (uid_t)-1 : args.main_user.user;
+    gid_t gid = args.main_user.ignore ? (gid_t)-1 : args.main_user.group;
+    if(stats_socket_open(path, uid, gid, stats_command) == -1){
+      TYM_U_LOG(TYM_LOG_FATAL, "Failed to create the stats socket\n");
+      return 1;
+    }
+  }
+
+  if(args.record){
+    if(command_record_open(args.record) == -1){
+      TYM_U_PERROR(TYM_LOG_FATAL, "failed to create the recording %s", args.record);
+      return 1;
+    }
+  }
+
+  // This needs privileges we may be about to drop
+  if(low_latency_enter(&args.low_latency) == -1){
+    TYM_U_LOG(TYM_LOG_FATAL, "Failed to enter low latency mode\n");
+    return 1;
+  }
 
   if(!args.main_user.ignore){
-    bool fatal = getpid() == 0;
+    bool fatal = getuid() == 0;
+    if(tty_link_created && keep_tty_link_caps() == -1){
+      TYM_U_PERROR(TYM_LOG_FATAL, "prctl(PR_SET_KEEPCAPS) failed");
+      return 1;
+    }
     if(setgid(args.main_user.group) == -1){
       TYM_U_PERROR(fatal ? TYM_LOG_FATAL : TYM_LOG_WARN, "setgid failed");
       if(fatal)
@@ -1036,6 +2244,11 @@ int main(int argc, char* argv[]){
       if(fatal)
         return 1;
     }
+    if(tty_link_created && getuid() != 0 && drop_to_tty_link_caps() == -1){
+      TYM_U_PERROR(TYM_LOG_FATAL, "failed to drop all capabilities except the ones for removing the pts");
+      return 1;
+    }
+    startup_trace_point("privileges_dropped", -1);
   }
 
   if(args.retain_pid && prctl(PR_SET_PDEATHSIG, SIGCHLD) == -1){
@@ -1048,28 +2261,17 @@ int main(int argc, char* argv[]){
     TYM_U_PERROR(TYM_LOG_FATAL, "tym_init failed");
     return 1;
   }
+  tym_frozen = false;
+  startup_trace_point("tym_init_resumed", -1);
 
-  // Wait for input
-  enum {
-    PFD_SIGCHILD,
-    PFD_KEYBOARDINPUT
-  };
-
-  struct pollfd fds[] = {
-    [PFD_SIGCHILD] = {
-      .fd = sfd[0],
-      .events = POLLIN
-    },
-    [PFD_KEYBOARDINPUT] = {
-      .fd = cfd[0],
-      .events = POLLIN
-    },
-  };
-  size_t nfds = sizeof(fds)/sizeof(*fds);
-
-  int p_remaining = 0;
-  int p_size = 0;
-  uint8_t p_buffer[257];
+  if(command_reader_init(&keyboard_reader, args.max_frame_size) == -1){
+    TYM_U_PERROR(TYM_LOG_FATAL, "command_reader_init failed");
+    return 1;
+  }
+  if(args.low_latency.enabled && command_reader_reserve(&keyboard_reader) == -1){
+    TYM_U_PERROR(TYM_LOG_FATAL, "command_reader_reserve failed");
+    return 1;
+  }
 
   if(args.print_fd >= 0){
     int ptsfd = tym_pane_get_slavefd(top_pane);
@@ -1085,68 +2287,120 @@ int main(int argc, char* argv[]){
     close(args.print_fd);
   }
 
-  while( true ){
+  // Wait for input
+  if(event_loop_init() == -1){
+    TYM_U_PERROR(TYM_LOG_FATAL, "event_loop_init failed");
+    return 1;
+  }
+
+  struct event_source child_notification_source = {
+    .name = "child notifier",
+    .events = EPOLLIN,
+    .priority = EVENT_PRIORITY_CHILD,
+    .handler = on_child_notification,
+  };
+  struct event_source child_exit_source[2] = {{
+    .name = "program pidfd",
+    .events = EPOLLIN | EPOLLHUP,
+    .priority = EVENT_PRIORITY_CHILD,
+    .handler = on_child_exit,
+    .ptr = (int[]){0},
+  },{
+    .name = "keyboard pidfd",
+    .events = EPOLLIN | EPOLLHUP,
+    .priority = EVENT_PRIORITY_CHILD,
+    .handler = on_child_exit,
+    .ptr = (int[]){1},
+  }};
+  struct event_source replay_source = {
+    .name = "replay timer",
+    .events = EPOLLIN,
+    .priority = EVENT_PRIORITY_KEYBOARD,
+    .handler = on_replay_timer,
+  };
+  struct event_source stats_source = {
+    .name = "stats signal",
+    .events = EPOLLIN,
+    .priority = EVENT_PRIORITY_DEFAULT,
+    .handler = on_stats_signal,
+  };
+  struct event_source termination_source = {
+    .name = "termination signals",
+    .events = EPOLLIN,
+    .priority = EVENT_PRIORITY_CHILD,
+    .handler = on_termination_signal,
+  };
 
-    int ret = poll(fds, nfds, -1);
-    if( ret == -1 ){
-      if( errno == EINTR )
-        continue;
-      TYM_U_PERROR(TYM_LOG_FATAL, "poll failed");
+  if(sfd[0] != -1){
+    fcntl(sfd[0], F_SETFL, O_NONBLOCK);
+    child_notification_source.fd = sfd[0];
+    if(event_loop_add(&child_notification_source) == -1)
       return 1;
-    }
-    if(!ret)
+  }
+  for(int i=0; i<2; i++){
+    if(child_pidfds[i] == -1)
       continue;
-
-    if(fds[PFD_SIGCHILD].revents & POLLIN){
-      bool out = false;
-      while(true){
-        unsigned char c = 0;
-        int r = read(fds[PFD_SIGCHILD].fd, &c, 1);
-        if(r == -1 && errno == EINTR)
-          continue;
-        if(r == 0 || (r == 1 && c == 0)){
-          out = true;
-          break;
-        }
-        break;
-      }
-      if(out)
-        break;
+    child_exit_source[i].fd = child_pidfds[i];
+    if(event_loop_add(&child_exit_source[i]) == -1)
+      return 1;
+  }
+  if(termination_notifier != -1){
+    termination_source.fd = termination_notifier;
+    if(event_loop_add(&termination_source) == -1)
+      return 1;
+  }
+  stats_notifier = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(stats_notifier == -1){
+    TYM_U_PERROR(TYM_LOG_FATAL, "eventfd failed");
+    return 1;
+  }
+  stats_source.fd = stats_notifier;
+  if(event_loop_add(&stats_source) == -1)
+    return 1;
+  signal(SIGUSR1, stats_signal);
+  if(stats_socket_watch() == -1)
+    return 1;
+  if(args.replay){
+    replay_source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if(replay_source.fd == -1){
+      TYM_U_PERROR(TYM_LOG_FATAL, "timerfd_create failed");
+      return 1;
     }
-
-    if(fds[PFD_KEYBOARDINPUT].revents & POLLIN){
-      unsigned char s;
-      if(!p_remaining){
-        if(read(cfd[0],&s,sizeof(s)) != 1)
-          continue;
-        p_size = s;
-        p_remaining = s;
-      }else{
-        int n = read(cfd[0], p_buffer + (p_size - p_remaining), p_remaining);
-        if(n <= 0)
-          continue;
-        if(n > p_remaining)
-          abort();
-        p_remaining -= n;
-        p_buffer[p_size] = 0;
-        if(!p_remaining)
-          parse(p_size, p_buffer);
-      }
+    replay_start = ckm_now();
+    if(!replay_pending){
+      TYM_U_LOG(TYM_LOG_INFO, "The recording is empty\n");
+      return 0;
     }
+    if(arm_replay_timer(replay_source.fd) == -1 || event_loop_add(&replay_source) == -1)
+      return 1;
+  }else{
+    keyboard_input_source.fd = cfd[0];
+    if(event_loop_add(&keyboard_input_source) == -1)
+      return 1;
+  }
+  if(keyboard_ring.ring){
+    keyboard_ring_source.fd = keyboard_ring.doorbell;
+    if(event_loop_add(&keyboard_ring_source) == -1)
+      return 1;
+  }
+  if(standby_pid != -1){
+    if(event_loop_add(&standby_exit_source) == -1)
+      return 1;
+  }
 
-    {
-      bool out = false;
-      for(size_t i=0; i<nfds; i++){
-        if(fds[i].revents & ~POLLIN){
-          TYM_U_LOG(TYM_LOG_FATAL, "fds[%zu]=%d: got unexpected revents: %lx\n", i, fds[i].fd, (unsigned long)fds[i].revents);
-          out = true;
-        }
-      }
-      if(out)
-        break;
+  while(!event_loop_stopped()){
+    if(event_loop_run_once(keyboard_size_timeout()) == -1){
+      TYM_U_PERROR(TYM_LOG_FATAL, "event_loop_run_once failed");
+      return 1;
     }
-
+    apply_pending_keyboard_size();
   }
 
+  log_stats();
+  command_reader_destroy(&keyboard_reader);
+  shm_ring_destroy(&keyboard_ring);
+  record_reader_close(&replay);
+  event_loop_destroy();
+
   return 0;
 }
@@ -0,0 +1,129 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libttymultiplex.h>
+#include <ckm_time.h>
+#include <event_loop.h>
+
+#define MAX_EVENTS 32
+
+struct event {
+  struct event_source* source;
+  uint32_t events;
+};
+
+static int epoll_fd = -1;
+static bool stopped = false;
+static uint64_t wakeup_time;
+static uint64_t wakeups;
+
+// The events currently being handled
+static size_t event_count;
+static struct event event_list[MAX_EVENTS];
+
+int event_loop_init(void){
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if(epoll_fd == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "epoll_create1 failed");
+    return -1;
+  }
+  stopped = false;
+  return 0;
+}
+
+void event_loop_destroy(void){
+  if(epoll_fd != -1)
+    close(epoll_fd);
+  epoll_fd = -1;
+}
+
+int event_loop_add(struct event_source* source){
+  struct epoll_event event = {
+    .events = source->events | EPOLLET,
+    .data.ptr = source
+  };
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &event) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "epoll_ctl(EPOLL_CTL_ADD) failed for %s", source->name);
+    return -1;
+  }
+  return 0;
+}
+
+int event_loop_remove(struct event_source* source){
+  for(size_t i=0; i<event_count; i++)
+    if(event_list[i].source == source)
+      event_list[i].source = 0;
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, 0) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "epoll_ctl(EPOLL_CTL_DEL) failed for %s", source->name);
+    return -1;
+  }
+  return 0;
+}
+
+int event_loop_run_once(int timeout){
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+  if(n == -1){
+    if(errno == EINTR)
+      return 0;
+    TYM_U_PERROR(TYM_LOG_ERROR, "epoll_wait failed");
+    return -1;
+  }
+  wakeup_time = ckm_now();
+  wakeups++;
+  // Sort by priority. There are only a few events, and the order of events
+  // with the same priority should stay the same.
+  event_count = n;
+  for(size_t i=0; i<event_count; i++){
+    struct event event = {
+      .source = events[i].data.ptr,
+      .events = events[i].events
+    };
+    size_t j = i;
+    for(; j>0 && event_list[j-1].source->priority > event.source->priority; j--)
+      event_list[j] = event_list[j-1];
+    event_list[j] = event;
+  }
+  for(size_t i=0; i<event_count && !stopped; i++){
+    struct event_source* source = event_list[i].source;
+    // Removed by an earlier handler
+    if(!source)
+      continue;
+    uint32_t events = event_list[i].events;
+    // The handler may free the source
+    uint32_t unexpected = events & (EPOLLERR|EPOLLHUP) & ~source->events;
+    if(unexpected)
+      TYM_U_LOG(TYM_LOG_FATAL, "%s (fd %d): got unexpected events: %lx\n", source->name, source->fd, (unsigned long)unexpected);
+    if(source->handler && (*source->handler)(source, events) == -1){
+      event_count = 0;
+      return -1;
+    }
+    if(unexpected)
+      stopped = true;
+  }
+  event_count = 0;
+  return 0;
+}
+
+uint64_t event_loop_wakeup_time(void){
+  return wakeup_time;
+}
+
+uint64_t event_loop_wakeups(void){
+  return wakeups;
+}
+
+void event_loop_reset_wakeups(void){
+  wakeups = 0;
+}
+
+void event_loop_stop(void){
+  stopped = true;
+}
+
+bool event_loop_stopped(void){
+  return stopped;
+}
@@ -0,0 +1,19 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include <key_transform.h>
+
+// @, A-Z, [, \, ], ^, _ and a-z map to 0x00-0x1F by clearing the upper 3 bits.
+static inline int is_plain_ctrl_char(uint8_t c){
+  return (c >= 0x40 && c <= 0x5F) || (c >= 'a' && c <= 'z');
+}
+
+size_t ctrl_transform(size_t n, uint8_t data[n]){
+  size_t m = 0;
+  while(m < n && is_plain_ctrl_char(data[m]))
+    m++;
+  // No branches in here, so the compiler can vectorize it
+  for(size_t i=0; i<m; i++)
+    data[i] &= 0x1F;
+  return m;
+}
@@ -0,0 +1,76 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include <string.h>
+#include <libttymultiplex.h>
+#include <latency_histogram.h>
+
+static unsigned bucket_of(uint64_t ns){
+  if(ns < LATENCY_HISTOGRAM_SUB_BUCKETS)
+    return ns;
+  unsigned e = 63 - __builtin_clzll(ns);
+  unsigned sub = (ns >> (e - 3)) & (LATENCY_HISTOGRAM_SUB_BUCKETS - 1);
+  return (e - 2) * LATENCY_HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+static uint64_t bucket_upper_bound(unsigned bucket){
+  if(bucket < LATENCY_HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+  unsigned e = bucket / LATENCY_HISTOGRAM_SUB_BUCKETS + 2;
+  uint64_t sub = bucket % LATENCY_HISTOGRAM_SUB_BUCKETS;
+  return ((LATENCY_HISTOGRAM_SUB_BUCKETS + sub + 1) << (e - 3)) - 1;
+}
+
+void latency_histogram_add(struct latency_histogram* histogram, uint64_t ns){
+  histogram->count++;
+  histogram->sum += ns;
+  if(histogram->max < ns)
+    histogram->max = ns;
+  histogram->buckets[bucket_of(ns)]++;
+}
+
+void latency_histogram_reset(struct latency_histogram* histogram){
+  memset(histogram, 0, sizeof(*histogram));
+}
+
+uint64_t latency_histogram_percentile(const struct latency_histogram* histogram, double p){
+  if(!histogram->count)
+    return 0;
+  uint64_t rank = p * histogram->count;
+  if(rank >= histogram->count)
+    rank = histogram->count - 1;
+  uint64_t seen = 0;
+  for(unsigned i=0; i<LATENCY_HISTOGRAM_BUCKETS; i++){
+    seen += histogram->buckets[i];
+    if(seen > rank){
+      uint64_t bound = bucket_upper_bound(i);
+      return bound < histogram->max ? bound : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+void latency_histogram_log(const struct latency_histogram* histogram, const char* name){
+  if(!histogram->count){
+    TYM_U_LOG(TYM_LOG_INFO, "%s: no samples\n", name);
+    return;
+  }
+  TYM_U_LOG(TYM_LOG_INFO, "%s: %llu samples, mean %.3fms, p50 %.3fms, p99 %.3fms, p99.9 %.3fms, max %.3fms\n",
+    name, (unsigned long long)histogram->count,
+    (double)histogram->sum / histogram->count / 1e6,
+    latency_histogram_percentile(histogram, 0.5) / 1e6,
+    latency_histogram_percentile(histogram, 0.99) / 1e6,
+    latency_histogram_percentile(histogram, 0.999) / 1e6,
+    histogram->max / 1e6
+  );
+}
+
+void latency_histogram_write(FILE* out, const struct latency_histogram* histogram, const char* name, const char* labels){
+  static const char* const quantiles[] = {"0.5", "0.99", "0.999"};
+  static const double values[] = {0.5, 0.99, 0.999};
+  const char* sep = *labels ? "," : "";
+  for(int i=0; i<3; i++)
+    fprintf(out, "%s{%s%squantile=\"%s\"} %.9f\n", name, labels, sep, quantiles[i], latency_histogram_percentile(histogram, values[i]) / 1e9);
+  fprintf(out, "%s_sum{%s} %.9f\n", name, labels, histogram->sum / 1e9);
+  fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)histogram->count);
+}
@@ -0,0 +1,109 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#define _GNU_SOURCE
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <libttymultiplex.h>
+#include <low_latency.h>
+
+// How much of the stack to fault in, so the main loop doesn't have to
+#define PREFAULT_STACK_SIZE (256 * 1024)
+
+static cpu_set_t cpus;
+static cpu_set_t original_cpus;
+static bool cpus_changed = false;
+static int original_nice;
+static bool nice_changed = false;
+
+int low_latency_parse_cpus(const char* list){
+  CPU_ZERO(&cpus);
+  while(true){
+    char* end = 0;
+    errno = 0;
+    unsigned long first = strtoul(list, &end, 10);
+    unsigned long last = first;
+    if(errno || end == list)
+      goto invalid;
+    if(*end == '-'){
+      list = end + 1;
+      last = strtoul(list, &end, 10);
+      if(errno || end == list || last < first)
+        goto invalid;
+    }
+    if(last >= CPU_SETSIZE)
+      goto invalid;
+    for(unsigned long i=first; i<=last; i++)
+      CPU_SET(i, &cpus);
+    if(!*end)
+      break;
+    if(*end != ',')
+      goto invalid;
+    list = end + 1;
+  }
+  return 0;
+invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+static void prefault_stack(void){
+  volatile char stack[PREFAULT_STACK_SIZE];
+  memset((char*)stack, 0, sizeof(stack));
+}
+
+int low_latency_enter(const struct low_latency_options* options){
+  if(!options->enabled)
+    return 0;
+  if(mlockall(MCL_CURRENT | MCL_FUTURE) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "mlockall failed");
+    return -1;
+  }
+  prefault_stack();
+  if(options->set_cpus){
+    if(sched_getaffinity(0, sizeof(original_cpus), &original_cpus) == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "sched_getaffinity failed");
+      return -1;
+    }
+    if(sched_setaffinity(0, sizeof(cpus), &cpus) == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "sched_setaffinity failed");
+      return -1;
+    }
+    cpus_changed = true;
+  }
+  if(options->set_nice){
+    errno = 0;
+    original_nice = getpriority(PRIO_PROCESS, 0);
+    if(original_nice == -1 && errno){
+      TYM_U_PERROR(TYM_LOG_ERROR, "getpriority failed");
+      return -1;
+    }
+    if(setpriority(PRIO_PROCESS, 0, options->nice) == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "setpriority failed");
+      return -1;
+    }
+    nice_changed = true;
+  }
+  // SCHED_RESET_ON_FORK resets the policy and a negative niceness in new processes, low_latency_leave a positive one
+  if(options->rt_priority || options->set_nice){
+    struct sched_param param = { .sched_priority = options->rt_priority };
+    int policy = options->rt_priority ? SCHED_FIFO : SCHED_OTHER;
+    if(sched_setscheduler(0, policy | SCHED_RESET_ON_FORK, &param) == -1){
+      TYM_U_PERROR(TYM_LOG_ERROR, "sched_setscheduler failed");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void low_latency_leave(void){
+  if(cpus_changed)
+    sched_setaffinity(0, sizeof(original_cpus), &original_cpus);
+  // Lowering the niceness again needs privileges, this only works before they were dropped
+  if(nice_changed)
+    setpriority(PRIO_PROCESS, 0, original_nice);
+}
@@ -0,0 +1,246 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pane_spawn.h>
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+// Use the syscalls directly, the libc wrappers would try to change the ids of all our threads too.
+#if defined(SYS_setgid32)
+#define SPAWN_SYS_SETGID SYS_setgid32
+#define SPAWN_SYS_SETUID SYS_setuid32
+#define SPAWN_SYS_SETGROUPS SYS_setgroups32
+#else
+#define SPAWN_SYS_SETGID SYS_setgid
+#define SPAWN_SYS_SETUID SYS_setuid
+#define SPAWN_SYS_SETGROUPS SYS_setgroups
+#endif
+
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+struct spawn_request {
+  const struct spawn_options* options;
+  const char* path;
+  sigset_t mask;
+  int error_pipe;
+};
+
+static int spawn_child(void* ptr){
+  const struct spawn_request* request = ptr;
+  const struct spawn_options* options = request->options;
+
+  // The signal handlers are in memory we share with the parent, don't let them run in here
+  for(int i=1; i<NSIG; i++){
+    struct sigaction action;
+    if(sigaction(i, 0, &action) == -1)
+      continue;
+    if(action.sa_handler == SIG_IGN || action.sa_handler == SIG_DFL)
+      continue;
+    signal(i, SIG_DFL);
+  }
+
+  if(setsid() == -1)
+    goto error;
+  if(ioctl(options->tty, TIOCSCTTY, 0) == -1)
+    goto error;
+  for(int i=0; i<3; i++)
+    if(dup2(options->tty, i) == -1)
+      goto error;
+
+  if(options->fd_count){
+    // Move the fds out of the way first, they may overlap with the target fds
+    int tmp[options->fd_count];
+    for(size_t i=0; i<options->fd_count; i++)
+      if((tmp[i] = fcntl(options->fds[i], F_DUPFD_CLOEXEC, 3 + options->fd_count)) == -1)
+        goto error;
+    for(size_t i=0; i<options->fd_count; i++)
+      if(dup2(tmp[i], 3 + i) == -1)
+        goto error;
+  }
+  // Don't leak any of our other fds, like the pane masters of libttymultiplex. We share our memory
+  // with the parent, so we can't use tym_zap like execpane does. CLOSE_RANGE_CLOEXEC needs linux 5.11,
+  // before that, this fails with ENOSYS or EINVAL, and start_pane falls back to execpane.
+#ifdef SYS_close_range
+  if(syscall(SYS_close_range, 3 + options->fd_count, ~0U, CLOSE_RANGE_CLOEXEC) == -1)
+    goto error;
+#else
+  errno = ENOSYS;
+  goto error;
+#endif
+
+  // Before changing the user, we may need our privileges to undo things, like a raised niceness
+  if(options->prepare)
+    options->prepare();
+
+  if(options->change_user){
+    if(syscall(SPAWN_SYS_SETGID, options->gid) == -1 && options->change_user_fatal)
+      goto error;
+    if(syscall(SPAWN_SYS_SETGROUPS, options->group_count, options->groups) == -1 && options->change_user_fatal)
+      goto error;
+    if(syscall(SPAWN_SYS_SETUID, options->uid) == -1 && options->change_user_fatal)
+      goto error;
+  }
+
+  sigprocmask(SIG_SETMASK, &request->mask, 0);
+  execve(request->path, options->argv, options->envp);
+
+error:;
+  int error = errno ? errno : 1;
+  while(write(request->error_pipe, &error, sizeof(error)) == -1 && errno == EINTR);
+  _exit(127);
+}
+
+// Search the program in PATH like execvp, but before the new process exists
+static int find_executable(const char* name, size_t size, char path[size]){
+  if(strchr(name, '/')){
+    if((size_t)snprintf(path, size, "%s", name) >= size){
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    return 0;
+  }
+  const char* search = getenv("PATH");
+  if(!search)
+    search = "/bin:/usr/bin";
+  int error = ENOENT;
+  while(true){
+    const char* end = strchrnul(search, ':');
+    int length = end - search;
+    if((size_t)snprintf(path, size, "%.*s%s%s", length, search, length ? "/" : "", name) < size){
+      if(access(path, X_OK) == 0)
+        return 0;
+      if(errno == EACCES)
+        error = EACCES;
+    }
+    if(!*end)
+      break;
+    search = end + 1;
+  }
+  errno = error;
+  return -1;
+}
+
+pid_t spawn_pane(const struct spawn_options* options, int* pidfd){
+  char path[PATH_MAX];
+  if(find_executable(options->argv[0], sizeof(path), path) == -1)
+    return -1;
+
+  int error_pipe[2];
+  if(pipe2(error_pipe, O_CLOEXEC) == -1)
+    return -1;
+
+  char* stack = malloc(SPAWN_STACK_SIZE);
+  if(!stack){
+    close(error_pipe[0]);
+    close(error_pipe[1]);
+    return -1;
+  }
+
+  struct spawn_request request = {
+    .options = options,
+    .path = path,
+    .error_pipe = error_pipe[1],
+  };
+
+  // Block all signals until the child got rid of our signal handlers
+  sigset_t all;
+  sigfillset(&all);
+  sigprocmask(SIG_SETMASK, &all, &request.mask);
+  int fd = -1;
+  pid_t pid = clone(spawn_child, stack + SPAWN_STACK_SIZE, CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &request, &fd);
+  int error = errno;
+  sigprocmask(SIG_SETMASK, &request.mask, 0);
+
+  free(stack);
+  close(error_pipe[1]);
+  if(pid == -1){
+    close(error_pipe[0]);
+    errno = error;
+    return -1;
+  }
+
+  // The pipe is closed without any data once the execve succeeded
+  int child_error = 0;
+  ssize_t n;
+  while((n = read(error_pipe[0], &child_error, sizeof(child_error))) == -1 && errno == EINTR);
+  close(error_pipe[0]);
+  if(n == sizeof(child_error)){
+    while(waitpid(pid, 0, 0) == -1 && errno == EINTR);
+    if(fd != -1)
+      close(fd);
+    errno = child_error;
+    return -1;
+  }
+
+  *pidfd = fd;
+  return pid;
+}
+
+int env_builder_init(struct env_builder* env, char* const* vars){
+  env->count = 0;
+  while(vars && vars[env->count])
+    env->count++;
+  env->vars = calloc(env->count + 1, sizeof(*env->vars));
+  if(!env->vars)
+    return -1;
+  for(size_t i=0; i<env->count; i++){
+    env->vars[i] = strdup(vars[i]);
+    if(!env->vars[i]){
+      env_builder_destroy(env);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int env_builder_set(struct env_builder* env, const char* name, const char* value){
+  size_t length = strlen(name);
+  char* var = malloc(length + strlen(value) + 2);
+  if(!var)
+    return -1;
+  sprintf(var, "%s=%s", name, value);
+  for(size_t i=0; i<env->count; i++){
+    if(strncmp(env->vars[i], name, length) || env->vars[i][length] != '=')
+      continue;
+    free(env->vars[i]);
+    env->vars[i] = var;
+    return 0;
+  }
+  char** vars = realloc(env->vars, (env->count + 2) * sizeof(*env->vars));
+  if(!vars){
+    free(var);
+    return -1;
+  }
+  env->vars = vars;
+  env->vars[env->count++] = var;
+  env->vars[env->count] = 0;
+  return 0;
+}
+
+void env_builder_destroy(struct env_builder* env){
+  if(env->vars)
+    for(size_t i=0; i<env->count; i++)
+      free(env->vars[i]);
+  free(env->vars);
+  env->vars = 0;
+  env->count = 0;
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <libttymultiplex.h>
+#include <shm_ring.h>
+
+int shm_ring_create(struct shm_ring_consumer* consumer, uint32_t size){
+  memset(consumer, 0, sizeof(*consumer));
+  consumer->memfd = -1;
+  consumer->doorbell = -1;
+  if(size < 256 || (size & (size - 1))){
+    errno = EINVAL;
+    return -1;
+  }
+  consumer->size = size;
+  size_t length = sizeof(struct shm_ring) + size;
+  consumer->memfd = memfd_create("console-keyboard-multiplexer-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(consumer->memfd == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "memfd_create failed");
+    goto error;
+  }
+  if(ftruncate(consumer->memfd, length) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "ftruncate failed");
+    goto error;
+  }
+  // The keyboard mustn't be able to shrink the memfd, we'd get a SIGBUS
+  if(fcntl(consumer->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "fcntl(F_ADD_SEALS) failed");
+    goto error;
+  }
+  void* ring = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, consumer->memfd, 0);
+  if(ring == MAP_FAILED){
+    TYM_U_PERROR(TYM_LOG_ERROR, "mmap failed");
+    goto error;
+  }
+  consumer->ring = ring;
+  consumer->ring->magic = SHM_RING_MAGIC;
+  consumer->ring->size = size;
+  consumer->doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(consumer->doorbell == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "eventfd failed");
+    goto error;
+  }
+  return 0;
+error:
+  shm_ring_destroy(consumer);
+  return -1;
+}
+
+void shm_ring_destroy(struct shm_ring_consumer* consumer){
+  if(consumer->ring)
+    munmap(consumer->ring, sizeof(struct shm_ring) + consumer->size);
+  if(consumer->memfd != -1)
+    close(consumer->memfd);
+  if(consumer->doorbell != -1)
+    close(consumer->doorbell);
+  consumer->ring = 0;
+  consumer->memfd = -1;
+  consumer->doorbell = -1;
+}
+
+int shm_ring_read(struct shm_ring_consumer* consumer, struct command_reader* reader, command_handler_t handler, void* ptr){
+  struct shm_ring* ring = consumer->ring;
+  uint32_t size = consumer->size;
+  uint64_t value;
+  while(read(consumer->doorbell, &value, sizeof(value)) == -1 && errno == EINTR);
+  size_t count = 0;
+  uint32_t tail = consumer->tail;
+  while(true){
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    uint32_t available = head - tail;
+    if(!available)
+      break;
+    if(available > size){
+      TYM_U_LOG(TYM_LOG_ERROR, "keyboard ring is corrupted: head=%lu tail=%lu\n", (unsigned long)head, (unsigned long)tail);
+      errno = EPROTO;
+      return -1;
+    }
+    uint32_t offset = tail & (size - 1);
+    uint32_t first = size - offset;
+    if(first > available)
+      first = available;
+    // The keyboard may run as another user, and could change the memory at any time,
+    // so the frames are copied out before they get parsed.
+    if(command_reader_feed(reader, first, ring->data + offset, handler, ptr, &count) == -1)
+      return -1;
+    if(available > first && command_reader_feed(reader, available - first, ring->data, handler, ptr, &count) == -1)
+      return -1;
+    tail += available;
+    consumer->tail = tail;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+  }
+  command_reader_count_wakeup(reader, count);
+  return count;
+}
@@ -0,0 +1,85 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libttymultiplex.h>
+#include <ckm_time.h>
+#include <startup_trace.h>
+
+#define MAX_TRACE_POINTS 64
+
+struct trace_point {
+  const char* name;
+  int index;
+  uint64_t time;
+};
+
+static int trace_fd = -1;
+static bool done;
+static size_t trace_point_count;
+static struct trace_point trace_points[MAX_TRACE_POINTS];
+
+int startup_trace_open(const char* target){
+  if(!strncmp(target, "fd:", 3)){
+    char* end = 0;
+    long fd = strtol(target + 3, &end, 10);
+    if(fd < 3 || (int)fd != fd || *end || !target[3]){
+      errno = EINVAL;
+      return -1;
+    }
+    if(fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+      return -1;
+    trace_fd = fd;
+  }else{
+    trace_fd = open(target, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(trace_fd == -1)
+      return -1;
+  }
+  return 0;
+}
+
+void startup_trace_point(const char* name, int index){
+  if(done || trace_point_count >= MAX_TRACE_POINTS)
+    return;
+  trace_points[trace_point_count++] = (struct trace_point){
+    .name = name,
+    .index = index,
+    .time = ckm_now()
+  };
+}
+
+void startup_trace_report(void){
+  done = true;
+  if(trace_fd == -1)
+    return;
+  uint64_t start = trace_point_count ? trace_points[0].time : 0;
+  dprintf(trace_fd, "# console-keyboard-multiplexer startup trace, pid %ld\n", (long)getpid());
+  for(size_t i=0; i<trace_point_count; i++){
+    const struct trace_point* point = &trace_points[i];
+    char index[16] = {0};
+    if(point->index >= 0)
+      snprintf(index, sizeof(index), "[%d]", point->index);
+    if(dprintf(trace_fd, "%s%s %llu %llu\n", point->name, index,
+        (unsigned long long)point->time,
+        (unsigned long long)(point->time - start) / 1000
+      ) < 0
+    ){
+      TYM_U_PERROR(TYM_LOG_WARN, "failed to write startup trace");
+      break;
+    }
+  }
+  close(trace_fd);
+  trace_fd = -1;
+}
+
+void startup_trace_abandon(void){
+  done = true;
+  if(trace_fd != -1)
+    close(trace_fd);
+  trace_fd = -1;
+}
@@ -0,0 +1,235 @@
+// Copyright (c) 2018 Daniel Abrecht
+// SPDX-License-Identifier: AGPL-3.0-or-later
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libttymultiplex.h>
+#include <ckm_time.h>
+#include <stats_socket.h>
+
+struct connection {
+  struct event_source source;
+  // Clients which haven't sent their request by then make room for new ones
+  uint64_t deadline;
+  size_t length;
+  char request[STATS_SOCKET_MAX_REQUEST + 1];
+};
+
+static char* socket_path;
+// Forked processes mustn't remove the socket
+static pid_t owner;
+static stats_socket_handler_t handler;
+static struct connection* connection_list[STATS_SOCKET_MAX_CONNECTIONS];
+
+static int on_connection(struct event_source* source, uint32_t events);
+static int on_listen(struct event_source* source, uint32_t events);
+
+static struct event_source listen_source = {
+  .name = "stats socket",
+  .fd = -1,
+  .events = EPOLLIN,
+  .priority = EVENT_PRIORITY_DEFAULT,
+  .handler = on_listen,
+};
+
+static int bind_socket(int fd, const struct sockaddr_un* address){
+  if(bind(fd, (const struct sockaddr*)address, sizeof(*address)) != -1)
+    return 0;
+  if(errno != EADDRINUSE)
+    return -1;
+  // Remove the socket of a previous instance which no longer exists
+  int check = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(check == -1)
+    return -1;
+  int ret = connect(check, (const struct sockaddr*)address, sizeof(*address));
+  int error = errno;
+  close(check);
+  if(ret != -1 || error != ECONNREFUSED){
+    errno = EADDRINUSE;
+    return -1;
+  }
+  if(unlink(address->sun_path) == -1)
+    return -1;
+  return bind(fd, (const struct sockaddr*)address, sizeof(*address));
+}
+
+int stats_socket_open(const char* path, uid_t uid, gid_t gid, stats_socket_handler_t h){
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if(strlen(path) >= sizeof(address.sun_path)){
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if(fd == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "socket failed");
+    return -1;
+  }
+  // The mode of the socket determines who can connect, don't leave it up to the umask
+  mode_t mask = umask(0117);
+  int ret = bind_socket(fd, &address);
+  umask(mask);
+  if(ret == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "failed to bind stats socket to %s", path);
+    close(fd);
+    return -1;
+  }
+  if(lchown(path, uid, gid) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "lchown failed");
+    unlink(path);
+    close(fd);
+    return -1;
+  }
+  if(listen(fd, STATS_SOCKET_MAX_CONNECTIONS) == -1){
+    TYM_U_PERROR(TYM_LOG_ERROR, "listen failed");
+    unlink(path);
+    close(fd);
+    return -1;
+  }
+  socket_path = strdup(path);
+  owner = getpid();
+  listen_source.fd = fd;
+  handler = h;
+  return 0;
+}
+
+int stats_socket_watch(void){
+  if(listen_source.fd == -1)
+    return 0;
+  return event_loop_add(&listen_source);
+}
+
+static void close_connection(struct connection* connection){
+  for(size_t i=0; i<STATS_SOCKET_MAX_CONNECTIONS; i++)
+    if(connection_list[i] == connection)
+      connection_list[i] = 0;
+  event_loop_remove(&connection->source);
+  close(connection->source.fd);
+  free(connection);
+}
+
+// Returns a free slot for a new connection, closing the ones which are past their deadline
+static struct connection** free_connection_slot(void){
+  struct connection** slot = 0;
+  uint64_t now = ckm_now();
+  for(size_t i=0; i<STATS_SOCKET_MAX_CONNECTIONS; i++){
+    if(connection_list[i] && connection_list[i]->deadline <= now)
+      close_connection(connection_list[i]);
+    if(!connection_list[i] && !slot)
+      slot = &connection_list[i];
+  }
+  return slot;
+}
+
+static void reply(struct connection* connection){
+  char* response = 0;
+  size_t size = 0;
+  FILE* out = open_memstream(&response, &size);
+  if(!out){
+    TYM_U_PERROR(TYM_LOG_ERROR, "open_memstream failed");
+    return;
+  }
+  connection->request[connection->length] = 0;
+  if((*handler)(out, connection->request) == -1)
+    fprintf(out, "error: unknown command \"%s\"\n", connection->request);
+  fclose(out);
+  // The reply is small enough to fit into the socket buffer, clients which don't read it don't get it
+  for(size_t i=0; i<size; ){
+    ssize_t n = send(connection->source.fd, response+i, size-i, MSG_NOSIGNAL);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      break;
+    i += n;
+  }
+  free(response);
+}
+
+static int on_connection(struct event_source* source, uint32_t events){
+  struct connection* connection = (struct connection*)source;
+  while(true){
+    ssize_t n = read(source->fd, connection->request + connection->length, STATS_SOCKET_MAX_REQUEST - connection->length);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1 && errno == EAGAIN && !(events & (EPOLLHUP|EPOLLERR)))
+      return 0;
+    if(n == -1){
+      close_connection(connection);
+      return 0;
+    }
+    char* end = memchr(connection->request + connection->length, '\n', n);
+    connection->length += n;
+    if(end){
+      connection->length = end - connection->request;
+      if(connection->length && end[-1] == '\r')
+        connection->length--;
+      break;
+    }
+    if(!n)
+      break;
+    if(connection->length >= STATS_SOCKET_MAX_REQUEST){
+      close_connection(connection);
+      return 0;
+    }
+  }
+  reply(connection);
+  close_connection(connection);
+  return 0;
+}
+
+static int on_listen(struct event_source* source, uint32_t events){
+  (void)events;
+  while(true){
+    int fd = accept4(source->fd, 0, 0, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if(fd == -1 && errno == EINTR)
+      continue;
+    if(fd == -1)
+      break;
+    struct connection** slot = free_connection_slot();
+    if(!slot){
+      close(fd);
+      continue;
+    }
+    struct connection* connection = calloc(1, sizeof(*connection));
+    if(!connection){
+      close(fd);
+      continue;
+    }
+    connection->source = (struct event_source){
+      .name = "stats connection",
+      .fd = fd,
+      .events = EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR,
+      .priority = EVENT_PRIORITY_DEFAULT,
+      .handler = on_connection,
+    };
+    connection->deadline = ckm_now() + STATS_SOCKET_TIMEOUT_MS * 1000000ull;
+    if(event_loop_add(&connection->source) == -1){
+      close(fd);
+      free(connection);
+      continue;
+    }
+    *slot = connection;
+  }
+  return 0;
+}
+
+void stats_socket_close(void){
+  if(listen_source.fd == -1 || getpid() != owner)
+    return;
+  close(listen_source.fd);
+  listen_source.fd = -1;
+  // This fails if privileges were dropped. The next instance removes the socket then.
+  if(socket_path && unlink(socket_path) == -1)
+    TYM_U_PERROR(TYM_LOG_DEBUG, "failed to remove %s", socket_path);
+  free(socket_path);
+  socket_path = 0;
+}